@@ -0,0 +1,146 @@
+#include "NMappedFile.h"
+#include <sys/stat.h>
+#include <iostream>
+#include <assert.h>
+
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+NMappedFile::NMappedFile():
+	 m_data(nullptr)
+	,m_size(0)
+#if defined(_WIN32)
+	,m_file(INVALID_HANDLE_VALUE)
+	,m_mapping(nullptr)
+#else
+	,m_file(-1)
+#endif
+{
+}
+
+NMappedFile::NMappedFile(const NMappedFile& other)
+{
+	assert(false);
+}
+
+NMappedFile::~NMappedFile()
+{
+	Close();
+}
+
+bool NMappedFile::Open(const char* path)
+{
+	Close();
+
+#if defined(_WIN32)
+	m_file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (m_file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(m_file, &size))
+	{
+		Close();
+		return false;
+	}
+	m_size = (uint64_t)size.QuadPart;
+	if (m_size == 0)
+	{
+		// Can't be mapped, open with no data
+		return true;
+	}
+	m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+	if (!m_mapping)
+	{
+		Close();
+		return false;
+	}
+	m_data = (uint8_t*)MapViewOfFile(m_mapping, FILE_MAP_COPY, 0, 0, 0);
+#else
+	m_file = open(path, O_RDONLY);
+	if (m_file < 0)
+	{
+		return false;
+	}
+	struct stat info;
+	if (fstat(m_file, &info) != 0)
+	{
+		Close();
+		return false;
+	}
+	m_size = (uint64_t)info.st_size;
+	if (m_size == 0)
+	{
+		// Can't be mapped, open with no data
+		return true;
+	}
+	void* data = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, m_file, 0);
+	m_data = data != MAP_FAILED ? (uint8_t*)data : nullptr;
+#endif
+
+	if (!m_data)
+	{
+		std::cout << "[NMappedFile][Open][Error]: Failed to map " << path << ". \n";
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void NMappedFile::Close()
+{
+#if defined(_WIN32)
+	if (m_data)
+	{
+		UnmapViewOfFile(m_data);
+	}
+	if (m_mapping)
+	{
+		CloseHandle(m_mapping);
+	}
+	if (m_file != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(m_file);
+	}
+	m_mapping = nullptr;
+	m_file = INVALID_HANDLE_VALUE;
+#else
+	if (m_data)
+	{
+		munmap(m_data, m_size);
+	}
+	if (m_file >= 0)
+	{
+		close(m_file);
+	}
+	m_file = -1;
+#endif
+	m_data = nullptr;
+	m_size = 0;
+}
+
+uint8_t* NMappedFile::GetData() const
+{
+	return m_data;
+}
+
+uint64_t NMappedFile::GetSize() const
+{
+	return m_size;
+}
+
+uint64_t NMappedFile::GetModifiedTime(const char* path)
+{
+	struct stat info;
+	if (stat(path, &info) != 0)
+	{
+		return 0;
+	}
+	return (uint64_t)info.st_mtime;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+/*
+  NMappedFile.h
+	Whole file mapped in memory. Pages are loaded by the OS on first access, so
+	opening big files is almost free. The view is copy on write, changes made
+	through it never reach the file.
+*/
+
+#include <stdint.h>
+
+class NMappedFile
+{
+public:
+	NMappedFile();
+	~NMappedFile();
+
+	// Empty files open with null data.
+	bool Open(const char* path);
+	void Close();
+
+	uint8_t* GetData()const;
+	uint64_t GetSize()const;
+
+	// Last modification time of a file, 0 if it can't be queried.
+	static uint64_t GetModifiedTime(const char* path);
+
+private:
+	NMappedFile(const NMappedFile& other);
+
+	uint8_t* m_data;
+	uint64_t m_size;
+#if defined(_WIN32)
+	void* m_file;
+	void* m_mapping;
+#else
+	int m_file;
+#endif
+};
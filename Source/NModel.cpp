@@ -1,29 +1,143 @@
 #include "NModel.h"
+#include "NMappedFile.h"
+#include "NObjParser.h"
+#include "tinythread.h"
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tiny_obj_loader.h"
 #include <iostream>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <stdio.h>
+#include <float.h>
+
+// Entries of the FIFO cache we optimize for, a common size for GPU post transform caches
+static const uint32_t kVertexCacheSize = 32;
+
+// Binary cache of a loaded model: header, vertices, indices. The header keeps the
+// vertices 16 byte aligned.
+static const uint32_t kMeshCacheMagic = 0x48534D4E;	// "NMSH"
+static const uint32_t kMeshCacheVersion = 2;
+static const uint32_t kLoaderFlags = tinyobj::calculate_normals | tinyobj::triangulation;
+static const uint32_t kCachedLoadFlags = ModelLoadFlags::Optimize | ModelLoadFlags::ParallelParser;
+
+struct MeshCacheHeader
+{
+	uint32_t Magic;
+	uint32_t Version;
+	uint64_t SourceTime;	// Modification time of the OBJ
+	uint32_t Flags;			// Loader and load flags used
+	uint32_t NumVertices;
+	uint32_t NumIndices;
+	uint32_t VertexSize;
+	AABB Bounds;	// Stored so loading doesn't touch every vertex
+	BoundingSphere Sphere;
+	uint8_t Padding[8];
+};
+static_assert(sizeof(MeshCacheHeader) % 16 == 0, "Vertices must stay aligned");
+
+// Average cache misses per triangle of a FIFO cache, 0.5 is the best a big mesh can get
+static float ComputeACMR(const uint32_t* indices, uint32_t numIndices, uint32_t numVertices)
+{
+	std::vector<uint32_t> cachedAt(numVertices, 0);
+	uint32_t time = kVertexCacheSize + 1;
+	uint32_t misses = 0;
+	for (uint32_t i = 0; i < numIndices; ++i)
+	{
+		if (time - cachedAt[indices[i]] > kVertexCacheSize)
+		{
+			cachedAt[indices[i]] = time++;
+			++misses;
+		}
+	}
+	return numIndices > 0 ? (float)misses / (float)(numIndices / 3) : 0.0f;
+}
 
 NModel::NModel():
 	m_vertices(nullptr)
 	,m_numVertices(0)
+	,m_indices(nullptr)
+	,m_numIndices(0)
+	,m_mappedFile(nullptr)
 {
+	m_bounds.Min = glm::vec3(0.0f);
+	m_bounds.Max = glm::vec3(0.0f);
+	m_boundingSphere.Center = glm::vec3(0.0f);
+	m_boundingSphere.Radius = 0.0f;
 }
 
 NModel::~NModel()
 {
-	if (m_vertices)
+	Release();
+}
+
+void NModel::Release()
+{
+	if (m_mappedFile)
+	{
+		delete m_mappedFile;
+	}
+	else
+	{
+		delete[] m_vertices;
+		delete[] m_indices;
+	}
+	m_mappedFile = nullptr;
+	m_vertices = nullptr;
+	m_indices = nullptr;
+	m_numVertices = 0;
+	m_numIndices = 0;
+}
+
+bool NModel::LoadFromfile(const char* path, uint32_t flags)
+{
+	Release();
+
+	// tinyobj flags in the low bits, ours in the high ones
+	bool useCache = (flags & ModelLoadFlags::NoCache) == 0;
+	std::string cachePath = std::string(path) + ".nmesh";
+	uint64_t sourceTime = NMappedFile::GetModifiedTime(path);
+	uint32_t cacheFlags = kLoaderFlags | ((flags & kCachedLoadFlags) << 16);
+	if (useCache && LoadFromCache(cachePath.c_str(), sourceTime, cacheFlags))
+	{
+		std::cout << "Loaded model from cache. \n";
+		return true;
+	}
+
+	bool success = (flags & ModelLoadFlags::ParallelParser) ? ParseWithNObjParser(path) : ParseWithTinyObj(path);
+	if (!success)
+	{
+		Release();
+		return false;
+	}
+
+	if (flags & ModelLoadFlags::Optimize)
 	{
-		delete m_vertices;
+		float acmr = ComputeACMR(m_indices, m_numIndices, m_numVertices);
+		OptimizeVertexCache();
+		OptimizeVertexFetch();
+		std::cout << "[NModel][LoadFromFile][Info]: ACMR " << acmr << " -> " << ComputeACMR(m_indices, m_numIndices, m_numVertices) << std::endl;
 	}
+
+	ComputeBounds();
+
+	if (useCache)
+	{
+		SaveToCache(cachePath.c_str(), sourceTime, cacheFlags);
+	}
+
+	std::cout << "Loaded model. \n";
+
+	return true;
 }
 
-bool NModel::LoadFromfile(const char* path)
+bool NModel::ParseWithTinyObj(const char* path)
 {
 	std::vector<tinyobj::shape_t> shapes;
 	std::vector<tinyobj::material_t> materials;
 	std::string error;
 
-	bool success = tinyobj::LoadObj(shapes, materials, error, path,nullptr,tinyobj::calculate_normals | tinyobj::triangulation);
+	bool success = tinyobj::LoadObj(shapes, materials, error, path,nullptr,kLoaderFlags);
 
 	if (!error.empty())
 	{
@@ -43,50 +157,61 @@ bool NModel::LoadFromfile(const char* path)
 		return false;
 	}
 
-	// Query loaded vtx:
+	// Query loaded vtx. Each shape already has one vertex per position/normal/uv combination
 	for (uint32_t s = 0; s < shapes.size(); ++s)
 	{
-		m_numVertices += shapes[s].mesh.indices.size();
+		m_numVertices += shapes[s].mesh.positions.size() / 3;
+		m_numIndices += shapes[s].mesh.indices.size();
 	}
 	m_vertices = new Vertex[m_numVertices];
+	m_indices = new uint32_t[m_numIndices];
 
-	// Iterate over shapes -> faces:
+	// Iterate over shapes -> vertices, faces:
 	uint32_t curVtx = 0;
+	uint32_t curIdx = 0;
 	for (uint32_t s = 0; s < shapes.size(); ++s)
 	{
-		size_t index_offset = 0;
-		for (uint32_t f = 0; f < shapes[s].mesh.indices.size(); ++f)
+		const tinyobj::mesh_t& mesh = shapes[s].mesh;
+		uint32_t baseVtx = curVtx;
+		for (uint32_t v = 0; v < mesh.positions.size() / 3; ++v)
 		{
-			int fv = shapes[s].mesh.num_vertices[f/3];
-			assert(fv == 3);
-
-			unsigned int idx = shapes[s].mesh.indices[f];
-
-			float vx = shapes[s].mesh.positions[3 * idx + 0];
-			float vy = shapes[s].mesh.positions[3 * idx + 1];
-			float vz = shapes[s].mesh.positions[3 * idx + 2];
-
-
-			float nx = shapes[s].mesh.normals[3 * idx + 0];
-			float ny = shapes[s].mesh.normals[3 * idx + 1];
-			float nz = shapes[s].mesh.normals[3 * idx + 2];
-
-			float u = shapes[s].mesh.texcoords[2 * idx + 0];
-			float v = shapes[s].mesh.texcoords[2 * idx + 1];
-
 			Vertex loadedVertex;
-			loadedVertex.Position = glm::vec4(vx, vy, vz,1.0f);
-			loadedVertex.Normal = glm::vec3(nx, ny, nz);
-			loadedVertex.TexCoord = glm::vec2(u, v);
+			loadedVertex.Position = glm::vec4(mesh.positions[3 * v + 0], mesh.positions[3 * v + 1], mesh.positions[3 * v + 2], 1.0f);
+			loadedVertex.Normal = glm::vec3(mesh.normals[3 * v + 0], mesh.normals[3 * v + 1], mesh.normals[3 * v + 2]);
+			loadedVertex.TexCoord = glm::vec2(mesh.texcoords[2 * v + 0], mesh.texcoords[2 * v + 1]);
 			m_vertices[curVtx] = loadedVertex;
-
 			++curVtx;
-			index_offset += fv;
+		}
+
+		for (uint32_t f = 0; f < mesh.indices.size(); ++f)
+		{
+			int fv = mesh.num_vertices[f / 3];
+			assert(fv == 3);
+
+			m_indices[curIdx] = baseVtx + mesh.indices[f];
+			++curIdx;
 		}
 	}
 
-	std::cout << "Loaded model. \n";
+	return true;
+}
 
+bool NModel::ParseWithNObjParser(const char* path)
+{
+	NObjParser parser;
+	if (!parser.Parse(path, (kLoaderFlags & tinyobj::calculate_normals) != 0, tthread::thread::hardware_concurrency()))
+	{
+		return false;
+	}
+
+	const std::vector<Vertex>& vertices = parser.GetVertices();
+	const std::vector<uint32_t>& indices = parser.GetIndices();
+	m_numVertices = (uint32_t)vertices.size();
+	m_numIndices = (uint32_t)indices.size();
+	m_vertices = new Vertex[m_numVertices];
+	m_indices = new uint32_t[m_numIndices];
+	std::copy(vertices.begin(), vertices.end(), m_vertices);
+	std::copy(indices.begin(), indices.end(), m_indices);
 	return true;
 }
 
@@ -104,3 +229,253 @@ uint32_t NModel::GetNumVertices() const
 {
 	return m_numVertices;
 }
+
+uint32_t* NModel::GetIndices() const
+{
+	return m_indices;
+}
+
+uint32_t NModel::GetNumIndices() const
+{
+	return m_numIndices;
+}
+
+const AABB& NModel::GetBounds() const
+{
+	return m_bounds;
+}
+
+const BoundingSphere& NModel::GetBoundingSphere() const
+{
+	return m_boundingSphere;
+}
+
+void NModel::ComputeBounds()
+{
+	if (m_numVertices == 0)
+	{
+		return;
+	}
+
+	m_bounds.Min = glm::vec3(FLT_MAX);
+	m_bounds.Max = glm::vec3(-FLT_MAX);
+	for (uint32_t i = 0; i < m_numVertices; ++i)
+	{
+		glm::vec3 position = glm::vec3(m_vertices[i].Position);
+		m_bounds.Min = glm::min(m_bounds.Min, position);
+		m_bounds.Max = glm::max(m_bounds.Max, position);
+	}
+
+	// Centered on the box, not the smallest one but close enough to cull with
+	m_boundingSphere.Center = (m_bounds.Min + m_bounds.Max) * 0.5f;
+	float radiusSq = 0.0f;
+	for (uint32_t i = 0; i < m_numVertices; ++i)
+	{
+		glm::vec3 offset = glm::vec3(m_vertices[i].Position) - m_boundingSphere.Center;
+		radiusSq = glm::max(radiusSq, glm::dot(offset, offset));
+	}
+	m_boundingSphere.Radius = glm::sqrt(radiusSq);
+}
+
+bool NModel::LoadFromCache(const char* cachePath, uint64_t sourceTime, uint32_t flags)
+{
+	NMappedFile* file = new NMappedFile;
+	if (!file->Open(cachePath) || file->GetSize() < sizeof(MeshCacheHeader))
+	{
+		delete file;
+		return false;
+	}
+
+	// Stale or written by another version, the OBJ gets parsed again and the cache overwritten
+	const MeshCacheHeader* header = (const MeshCacheHeader*)file->GetData();
+	uint64_t expectedSize = sizeof(MeshCacheHeader) + (uint64_t)header->NumVertices * sizeof(Vertex) + (uint64_t)header->NumIndices * sizeof(uint32_t);
+	if (header->Magic != kMeshCacheMagic || header->Version != kMeshCacheVersion || header->VertexSize != sizeof(Vertex) ||
+		header->SourceTime != sourceTime || header->Flags != flags || file->GetSize() != expectedSize)
+	{
+		delete file;
+		return false;
+	}
+
+	// Point straight into the mapping, nothing is copied or parsed
+	uint8_t* data = file->GetData() + sizeof(MeshCacheHeader);
+	m_mappedFile = file;
+	m_vertices = (Vertex*)data;
+	m_numVertices = header->NumVertices;
+	m_indices = (uint32_t*)(data + m_numVertices * sizeof(Vertex));
+	m_numIndices = header->NumIndices;
+	m_bounds = header->Bounds;
+	m_boundingSphere = header->Sphere;
+	return true;
+}
+
+void NModel::SaveToCache(const char* cachePath, uint64_t sourceTime, uint32_t flags) const
+{
+	FILE* file = fopen(cachePath, "wb");
+	if (!file)
+	{
+		std::cout << "[NModel][SaveToCache][Warning]: Could not write " << cachePath << ". \n";
+		return;
+	}
+
+	// Zeroes the padding too, so the file is the same for the same model
+	MeshCacheHeader header = {};
+	header.Magic = kMeshCacheMagic;
+	header.Version = kMeshCacheVersion;
+	header.SourceTime = sourceTime;
+	header.Flags = flags;
+	header.NumVertices = m_numVertices;
+	header.NumIndices = m_numIndices;
+	header.VertexSize = sizeof(Vertex);
+	header.Bounds = m_bounds;
+	header.Sphere = m_boundingSphere;
+
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+	written = written && fwrite(m_vertices, sizeof(Vertex), m_numVertices, file) == m_numVertices;
+	written = written && fwrite(m_indices, sizeof(uint32_t), m_numIndices, file) == m_numIndices;
+	fclose(file);
+
+	// Never leave a truncated cache behind
+	if (!written)
+	{
+		std::cout << "[NModel][SaveToCache][Warning]: Could not write " << cachePath << ". \n";
+		remove(cachePath);
+	}
+}
+
+void NModel::OptimizeVertexCache()
+{
+	// Tipsify (Sander et al. 2007). Emits fans around a vertex and moves on to the neighbour that
+	// will still be in the FIFO cache after emitting its own triangles.
+	uint32_t numTriangles = m_numIndices / 3;
+
+	// Triangles using each vertex
+	std::vector<uint32_t> adjacencyOffset(m_numVertices + 1, 0);
+	for (uint32_t i = 0; i < numTriangles * 3; ++i)
+	{
+		++adjacencyOffset[m_indices[i] + 1];
+	}
+	for (uint32_t v = 0; v < m_numVertices; ++v)
+	{
+		adjacencyOffset[v + 1] += adjacencyOffset[v];
+	}
+	std::vector<uint32_t> adjacency(numTriangles * 3);
+	std::vector<uint32_t> liveTriangles(m_numVertices, 0);
+	for (uint32_t i = 0; i < numTriangles * 3; ++i)
+	{
+		uint32_t v = m_indices[i];
+		adjacency[adjacencyOffset[v] + liveTriangles[v]] = i / 3;
+		++liveTriangles[v];
+	}
+
+	std::vector<uint32_t> cachedAt(m_numVertices, 0);
+	std::vector<bool> emitted(numTriangles, false);
+	std::vector<uint32_t> deadEnds;
+	std::vector<uint32_t> candidates;
+	std::vector<uint32_t> optimized;
+	optimized.reserve(numTriangles * 3);
+
+	uint32_t time = kVertexCacheSize + 1;
+	uint32_t cursor = 0;
+	int64_t fanning = m_numVertices > 0 ? 0 : -1;
+	while (fanning >= 0)
+	{
+		// Emit all the triangles around the fanning vertex
+		candidates.clear();
+		for (uint32_t a = adjacencyOffset[fanning]; a < adjacencyOffset[fanning + 1]; ++a)
+		{
+			uint32_t t = adjacency[a];
+			if (emitted[t])
+			{
+				continue;
+			}
+			for (uint32_t c = 0; c < 3; ++c)
+			{
+				uint32_t v = m_indices[t * 3 + c];
+				optimized.push_back(v);
+				deadEnds.push_back(v);
+				candidates.push_back(v);
+				--liveTriangles[v];
+				if (time - cachedAt[v] > kVertexCacheSize)
+				{
+					cachedAt[v] = time++;
+				}
+			}
+			emitted[t] = true;
+		}
+
+		// Next fanning vertex: the candidate that stays longest in the cache once its fan is emitted
+		fanning = -1;
+		int64_t bestPriority = -1;
+		for (uint32_t c = 0; c < candidates.size(); ++c)
+		{
+			uint32_t v = candidates[c];
+			if (liveTriangles[v] == 0)
+			{
+				continue;
+			}
+			int64_t priority = 0;
+			if (time - cachedAt[v] + 2 * liveTriangles[v] <= kVertexCacheSize)
+			{
+				priority = time - cachedAt[v];
+			}
+			if (priority > bestPriority)
+			{
+				bestPriority = priority;
+				fanning = v;
+			}
+		}
+
+		// Dead end, go back to a recently used vertex or to the next one with triangles left
+		while (fanning < 0 && !deadEnds.empty())
+		{
+			uint32_t v = deadEnds.back();
+			deadEnds.pop_back();
+			if (liveTriangles[v] > 0)
+			{
+				fanning = v;
+			}
+		}
+		while (fanning < 0 && cursor < m_numVertices)
+		{
+			if (liveTriangles[cursor] > 0)
+			{
+				fanning = cursor;
+			}
+			++cursor;
+		}
+	}
+
+	assert(optimized.size() == numTriangles * 3);
+	for (uint32_t i = 0; i < optimized.size(); ++i)
+	{
+		m_indices[i] = optimized[i];
+	}
+}
+
+void NModel::OptimizeVertexFetch()
+{
+	// Vertices in the order the indices first reference them, unused ones go to the end
+	std::vector<uint32_t> remap(m_numVertices, UINT32_MAX);
+	Vertex* vertices = new Vertex[m_numVertices];
+	uint32_t next = 0;
+	for (uint32_t i = 0; i < m_numIndices; ++i)
+	{
+		uint32_t& newIndex = remap[m_indices[i]];
+		if (newIndex == UINT32_MAX)
+		{
+			newIndex = next++;
+			vertices[newIndex] = m_vertices[m_indices[i]];
+		}
+		m_indices[i] = newIndex;
+	}
+	for (uint32_t v = 0; v < m_numVertices; ++v)
+	{
+		if (remap[v] == UINT32_MAX)
+		{
+			vertices[next++] = m_vertices[v];
+		}
+	}
+
+	delete[] m_vertices;
+	m_vertices = vertices;
+}
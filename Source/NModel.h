@@ -8,6 +8,8 @@
 
 #include "glm.hpp"
 
+class NMappedFile;
+
 struct Vertex
 {
 	Vertex()
@@ -41,18 +43,65 @@ struct Vertex
 	glm::vec2 TexCoord;
 };
 
+// Axis aligned bounding box
+struct AABB
+{
+	glm::vec3 Min;
+	glm::vec3 Max;
+};
+
+struct BoundingSphere
+{
+	glm::vec3 Center;
+	float Radius;
+};
+
+struct ModelLoadFlags
+{
+	enum T
+	{
+		Optimize		= 1 << 0,	// Reorder triangles for the post transform cache and vertices by first use
+		ParallelParser	= 1 << 1,	// Parse with NObjParser instead of tinyobj, for big files
+		NoCache			= 1 << 2,	// Always parse the OBJ, don't read nor write path.nmesh
+
+		Default = Optimize
+	};
+};
+
 class NModel
 {
 public:
 	NModel();
 	~NModel();
 
-	bool LoadFromfile(const char* path);
+	// The result is cached next to the OBJ (path.nmesh) and mapped straight from there
+	// on the next loads. Flags are a combination of ModelLoadFlags.
+	bool LoadFromfile(const char* path, uint32_t flags = ModelLoadFlags::Default);
 	Vertex* GetAllVertex()const;
 	Vertex* GetVertexAt(uint32_t idx)const;
 	uint32_t GetNumVertices()const;
+	// Triangle list indexing the vertices, draw it with NRaster::DrawIndexed.
+	uint32_t* GetIndices()const;
+	uint32_t GetNumIndices()const;
+	// Object space bounds, computed at load. Pass them to NRaster::SetDrawBounds to cull the draws.
+	const AABB& GetBounds()const;
+	const BoundingSphere& GetBoundingSphere()const;
 
 private:
+	void Release();
+	bool ParseWithTinyObj(const char* path);
+	bool ParseWithNObjParser(const char* path);
+	bool LoadFromCache(const char* cachePath, uint64_t sourceTime, uint32_t flags);
+	void SaveToCache(const char* cachePath, uint64_t sourceTime, uint32_t flags)const;
+	void OptimizeVertexCache();
+	void OptimizeVertexFetch();
+	void ComputeBounds();
+
 	Vertex* m_vertices;
 	uint32_t m_numVertices;
+	uint32_t* m_indices;
+	uint32_t m_numIndices;
+	AABB m_bounds;
+	BoundingSphere m_boundingSphere;
+	NMappedFile* m_mappedFile;	// Owns the vertices and indices when loaded from the cache
 };
\ No newline at end of file
@@ -0,0 +1,520 @@
+#include "NObjParser.h"
+#include "NMappedFile.h"
+#include "NThreadPool.h"
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <assert.h>
+
+// Chunks per worker so uneven ones are balanced by stealing, and the smallest chunk worth a job
+static const uint32_t kChunksPerWorker = 4;
+static const uint64_t kMinChunkSize = 64 * 1024;
+// Marks a missing uv or normal in a corner
+static const int32_t kNoIndex = INT32_MIN;
+
+static const double kPow10[] =
+{
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+	1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline bool IsSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline const char* SkipSpaces(const char* cur, const char* end)
+{
+	while (cur < end && IsSpace(*cur))
+	{
+		++cur;
+	}
+	return cur;
+}
+
+static inline const char* SkipLine(const char* cur, const char* end)
+{
+	while (cur < end && *cur != '\n')
+	{
+		++cur;
+	}
+	return cur < end ? cur + 1 : end;
+}
+
+// Handles the plain decimals OBJs are made of without going through the locale. Values with
+// 15 significant digits or less are exact, longer ones fall back to strtod.
+static bool ParseFloat(const char*& cur, const char* end, float& value)
+{
+	const char* start = cur;
+	bool negative = false;
+	if (cur < end && (*cur == '-' || *cur == '+'))
+	{
+		negative = *cur == '-';
+		++cur;
+	}
+
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int exponent = 0;
+	bool any = false;
+	for (; cur < end && *cur >= '0' && *cur <= '9'; ++cur, any = true)
+	{
+		if (digits < 19)
+		{
+			mantissa = mantissa * 10 + (*cur - '0');
+			digits += mantissa > 0 ? 1 : 0;
+		}
+		else
+		{
+			++exponent;
+		}
+	}
+	if (cur < end && *cur == '.')
+	{
+		++cur;
+		for (; cur < end && *cur >= '0' && *cur <= '9'; ++cur, any = true)
+		{
+			if (digits < 19)
+			{
+				mantissa = mantissa * 10 + (*cur - '0');
+				digits += mantissa > 0 ? 1 : 0;
+				--exponent;
+			}
+		}
+	}
+	if (!any)
+	{
+		return false;
+	}
+	if (cur < end && (*cur == 'e' || *cur == 'E'))
+	{
+		++cur;
+		bool negativeExp = false;
+		if (cur < end && (*cur == '-' || *cur == '+'))
+		{
+			negativeExp = *cur == '-';
+			++cur;
+		}
+		int exp = 0;
+		for (; cur < end && *cur >= '0' && *cur <= '9'; ++cur)
+		{
+			exp = exp < 10000 ? exp * 10 + (*cur - '0') : exp;
+		}
+		exponent += negativeExp ? -exp : exp;
+	}
+
+	if (digits > 15 || exponent < -22 || exponent > 22)
+	{
+		// strtod needs a terminated string, the token is never long
+		char token[64];
+		size_t length = glm::min((size_t)(cur - start), sizeof(token) - 1);
+		memcpy(token, start, length);
+		token[length] = '\0';
+		value = (float)strtod(token, nullptr);
+		return true;
+	}
+
+	double result = (double)mantissa;
+	result = exponent < 0 ? result / kPow10[-exponent] : result * kPow10[exponent];
+	value = (float)(negative ? -result : result);
+	return true;
+}
+
+static bool ParseInt(const char*& cur, const char* end, int32_t& value)
+{
+	bool negative = false;
+	if (cur < end && (*cur == '-' || *cur == '+'))
+	{
+		negative = *cur == '-';
+		++cur;
+	}
+	if (cur >= end || *cur < '0' || *cur > '9')
+	{
+		return false;
+	}
+	int64_t result = 0;
+	for (; cur < end && *cur >= '0' && *cur <= '9'; ++cur)
+	{
+		result = result * 10 + (*cur - '0');
+		if (result > INT32_MAX)
+		{
+			return false;
+		}
+	}
+	value = (int32_t)(negative ? -result : result);
+	return true;
+}
+
+// OBJ indices start at 1, negative ones are relative to the elements read so far. Those
+// are kept relative to the chunk start (and may point to a previous chunk) until merging.
+static inline bool ToCornerIndex(int32_t objIndex, uint32_t localCount, uint32_t relativeBit, uint32_t& relativeMask, int32_t& index)
+{
+	if (objIndex > 0)
+	{
+		index = objIndex - 1;
+		return true;
+	}
+	if (objIndex < 0)
+	{
+		index = (int32_t)localCount + objIndex;
+		relativeMask |= relativeBit;
+		return true;
+	}
+	return false;
+}
+
+NObjParser::NObjParser()
+{
+}
+
+NObjParser::NObjParser(const NObjParser& other)
+{
+	assert(false);
+}
+
+NObjParser::~NObjParser()
+{
+}
+
+bool NObjParser::Parse(const char* path, bool calculateNormals, uint32_t numWorkers)
+{
+	m_chunks.clear();
+	m_vertices.clear();
+	m_indices.clear();
+
+	NMappedFile file;
+	if (!file.Open(path))
+	{
+		std::cout << "[NObjParser][Parse][Error]: Could not open " << path << ". \n";
+		return false;
+	}
+	if (file.GetSize() == 0)
+	{
+		// Nothing to parse, an empty model like tinyobj loads
+		return true;
+	}
+	const char* data = (const char*)file.GetData();
+	const char* dataEnd = data + file.GetSize();
+
+	// Split on line boundaries
+	numWorkers = glm::max(numWorkers, 1u);
+	uint64_t numChunks = glm::max(glm::min((uint64_t)numWorkers * kChunksPerWorker, file.GetSize() / kMinChunkSize), (uint64_t)1);
+	uint64_t chunkSize = (file.GetSize() + numChunks - 1) / numChunks;
+	m_chunks.reserve((size_t)numChunks);
+	const char* chunkBegin = data;
+	while (chunkBegin < dataEnd)
+	{
+		const char* chunkEnd = (uint64_t)(dataEnd - chunkBegin) > chunkSize ? chunkBegin + chunkSize : dataEnd;
+		chunkEnd = chunkEnd < dataEnd ? SkipLine(chunkEnd, dataEnd) : dataEnd;
+
+		Chunk chunk;
+		chunk.Parser = this;
+		chunk.Begin = chunkBegin;
+		chunk.End = chunkEnd;
+		chunk.PositionOffset = 0;
+		chunk.TexCoordOffset = 0;
+		chunk.NormalOffset = 0;
+		chunk.Failed = false;
+		m_chunks.push_back(chunk);
+		chunkBegin = chunkEnd;
+	}
+
+	// A single chunk doesn't need any thread
+	NThreadPool* pool = nullptr;
+	if (m_chunks.size() > 1)
+	{
+		pool = new NThreadPool;
+		pool->Initialize(glm::min(numWorkers, (uint32_t)m_chunks.size()));
+	}
+
+	for (uint32_t c = 0; c < m_chunks.size(); ++c)
+	{
+		pool ? pool->Submit(NObjParser::ParseChunkJob, &m_chunks[c]) : ParseChunkJob(&m_chunks[c]);
+	}
+	if (pool)
+	{
+		pool->WaitIdle();
+	}
+
+	// Where the elements of each chunk go in the merged arrays
+	uint32_t numPositions = 0;
+	uint32_t numTexCoords = 0;
+	uint32_t numNormals = 0;
+	bool failed = false;
+	for (uint32_t c = 0; c < m_chunks.size(); ++c)
+	{
+		Chunk& chunk = m_chunks[c];
+		chunk.PositionOffset = numPositions;
+		chunk.TexCoordOffset = numTexCoords;
+		chunk.NormalOffset = numNormals;
+		numPositions += (uint32_t)chunk.Positions.size();
+		numTexCoords += (uint32_t)chunk.TexCoords.size();
+		numNormals += (uint32_t)chunk.Normals.size();
+		failed = failed || chunk.Failed;
+	}
+
+	if (!failed)
+	{
+		m_positions.resize(numPositions);
+		m_texCoords.resize(numTexCoords);
+		m_normals.resize(numNormals);
+		for (uint32_t c = 0; c < m_chunks.size(); ++c)
+		{
+			pool ? pool->Submit(NObjParser::ResolveChunkJob, &m_chunks[c]) : ResolveChunkJob(&m_chunks[c]);
+		}
+		if (pool)
+		{
+			pool->WaitIdle();
+		}
+		for (uint32_t c = 0; c < m_chunks.size(); ++c)
+		{
+			failed = failed || m_chunks[c].Failed;
+		}
+	}
+	delete pool;
+
+	if (failed)
+	{
+		std::cout << "[NObjParser][Parse][Error]: Malformed data in " << path << ". \n";
+	}
+	bool success = !failed && BuildVertices(calculateNormals);
+
+	m_chunks.clear();
+	m_positions.clear();
+	m_texCoords.clear();
+	m_normals.clear();
+	return success;
+}
+
+const std::vector<Vertex>& NObjParser::GetVertices() const
+{
+	return m_vertices;
+}
+
+const std::vector<uint32_t>& NObjParser::GetIndices() const
+{
+	return m_indices;
+}
+
+void NObjParser::ParseChunkJob(void* chunk)
+{
+	Chunk* self = (Chunk*)chunk;
+	self->Failed = !ParseChunk(*self);
+}
+
+void NObjParser::ResolveChunkJob(void* chunk)
+{
+	Chunk* self = (Chunk*)chunk;
+	self->Parser->ResolveChunk(*self);
+}
+
+bool NObjParser::ParseChunk(Chunk& chunk)
+{
+	const char* cur = chunk.Begin;
+	const char* end = chunk.End;
+	std::vector<Corner> face;
+
+	while (cur < end)
+	{
+		cur = SkipSpaces(cur, end);
+		if (cur + 1 >= end)
+		{
+			break;
+		}
+
+		if (cur[0] == 'v' && IsSpace(cur[1]))
+		{
+			cur += 2;
+			glm::vec3 position;
+			for (int i = 0; i < 3; ++i)
+			{
+				cur = SkipSpaces(cur, end);
+				if (!ParseFloat(cur, end, position[i]))
+				{
+					return false;
+				}
+			}
+			chunk.Positions.push_back(position);
+		}
+		else if (cur[0] == 'v' && cur[1] == 't' && cur + 2 < end && IsSpace(cur[2]))
+		{
+			cur += 3;
+			glm::vec2 texCoord;
+			for (int i = 0; i < 2; ++i)
+			{
+				cur = SkipSpaces(cur, end);
+				if (!ParseFloat(cur, end, texCoord[i]))
+				{
+					return false;
+				}
+			}
+			chunk.TexCoords.push_back(texCoord);
+		}
+		else if (cur[0] == 'v' && cur[1] == 'n' && cur + 2 < end && IsSpace(cur[2]))
+		{
+			cur += 3;
+			glm::vec3 normal;
+			for (int i = 0; i < 3; ++i)
+			{
+				cur = SkipSpaces(cur, end);
+				if (!ParseFloat(cur, end, normal[i]))
+				{
+					return false;
+				}
+			}
+			chunk.Normals.push_back(normal);
+		}
+		else if (cur[0] == 'f' && IsSpace(cur[1]))
+		{
+			// v, v/vt, v//vn or v/vt/vn per corner
+			cur += 2;
+			face.clear();
+			while ((cur = SkipSpaces(cur, end)) < end && *cur != '\n')
+			{
+				Corner corner;
+				corner.TexCoord = kNoIndex;
+				corner.Normal = kNoIndex;
+				corner.RelativeMask = 0;
+				int32_t objIndex;
+				if (!ParseInt(cur, end, objIndex) || !ToCornerIndex(objIndex, (uint32_t)chunk.Positions.size(), 1 << 0, corner.RelativeMask, corner.Position))
+				{
+					return false;
+				}
+				if (cur < end && *cur == '/')
+				{
+					++cur;
+					if (cur < end && *cur != '/')
+					{
+						if (!ParseInt(cur, end, objIndex) || !ToCornerIndex(objIndex, (uint32_t)chunk.TexCoords.size(), 1 << 1, corner.RelativeMask, corner.TexCoord))
+						{
+							return false;
+						}
+					}
+					if (cur < end && *cur == '/')
+					{
+						++cur;
+						if (!ParseInt(cur, end, objIndex) || !ToCornerIndex(objIndex, (uint32_t)chunk.Normals.size(), 1 << 2, corner.RelativeMask, corner.Normal))
+						{
+							return false;
+						}
+					}
+				}
+				face.push_back(corner);
+			}
+			for (size_t i = 1; i + 1 < face.size(); ++i)
+			{
+				chunk.Corners.push_back(face[0]);
+				chunk.Corners.push_back(face[i]);
+				chunk.Corners.push_back(face[i + 1]);
+			}
+		}
+
+		// Comments, groups, materials etc. are skipped
+		cur = SkipLine(cur, end);
+	}
+	return true;
+}
+
+void NObjParser::ResolveChunk(Chunk& chunk)
+{
+	std::copy(chunk.Positions.begin(), chunk.Positions.end(), m_positions.begin() + chunk.PositionOffset);
+	std::copy(chunk.TexCoords.begin(), chunk.TexCoords.end(), m_texCoords.begin() + chunk.TexCoordOffset);
+	std::copy(chunk.Normals.begin(), chunk.Normals.end(), m_normals.begin() + chunk.NormalOffset);
+
+	// Chunk local indices to global ones, and check all of them are in range
+	for (size_t i = 0; i < chunk.Corners.size(); ++i)
+	{
+		Corner& corner = chunk.Corners[i];
+		corner.Position += (corner.RelativeMask & (1 << 0)) ? (int32_t)chunk.PositionOffset : 0;
+		corner.TexCoord += (corner.RelativeMask & (1 << 1)) ? (int32_t)chunk.TexCoordOffset : 0;
+		corner.Normal += (corner.RelativeMask & (1 << 2)) ? (int32_t)chunk.NormalOffset : 0;
+		corner.RelativeMask = 0;
+
+		bool valid = corner.Position >= 0 && corner.Position < (int32_t)m_positions.size();
+		valid = valid && (corner.TexCoord == kNoIndex || (corner.TexCoord >= 0 && corner.TexCoord < (int32_t)m_texCoords.size()));
+		valid = valid && (corner.Normal == kNoIndex || (corner.Normal >= 0 && corner.Normal < (int32_t)m_normals.size()));
+		if (!valid)
+		{
+			chunk.Failed = true;
+			return;
+		}
+	}
+	chunk.Positions.clear();
+	chunk.TexCoords.clear();
+	chunk.Normals.clear();
+}
+
+bool NObjParser::BuildVertices(bool calculateNormals)
+{
+	// One vertex per different combination, in the order they are first used. Variants of a
+	// position are chained from it, there are rarely more than a few.
+	std::vector<int32_t> firstVariant(m_positions.size(), -1);
+	std::vector<int32_t> nextVariant;
+	std::vector<Corner> vertexCorners;
+	for (uint32_t c = 0; c < m_chunks.size(); ++c)
+	{
+		const std::vector<Corner>& corners = m_chunks[c].Corners;
+		for (size_t i = 0; i < corners.size(); ++i)
+		{
+			const Corner& corner = corners[i];
+			int32_t vertex = firstVariant[corner.Position];
+			int32_t last = -1;
+			while (vertex >= 0 && (vertexCorners[vertex].TexCoord != corner.TexCoord || vertexCorners[vertex].Normal != corner.Normal))
+			{
+				last = vertex;
+				vertex = nextVariant[vertex];
+			}
+			if (vertex < 0)
+			{
+				vertex = (int32_t)vertexCorners.size();
+				vertexCorners.push_back(corner);
+				nextVariant.push_back(-1);
+				(last < 0 ? firstVariant[corner.Position] : nextVariant[last]) = vertex;
+			}
+			m_indices.push_back((uint32_t)vertex);
+		}
+	}
+
+	m_vertices.resize(vertexCorners.size());
+	for (size_t v = 0; v < vertexCorners.size(); ++v)
+	{
+		const Corner& corner = vertexCorners[v];
+		const glm::vec3& position = m_positions[corner.Position];
+		Vertex& vertex = m_vertices[v];
+		vertex.Position = glm::vec4(position.x, position.y, position.z, 1.0f);
+		vertex.Normal = corner.Normal != kNoIndex ? m_normals[corner.Normal] : glm::vec3(0.0f);
+		vertex.Color = glm::vec3(0.0f);
+		vertex.TexCoord = corner.TexCoord != kNoIndex ? m_texCoords[corner.TexCoord] : glm::vec2(0.0f);
+	}
+
+	// Smooth normals for the corners without one, weighted by the area of the triangles. The ones
+	// from the file are kept, faces with and without them can be mixed.
+	if (calculateNormals)
+	{
+		for (size_t i = 0; i + 2 < m_indices.size(); i += 3)
+		{
+			glm::vec3 p0(m_vertices[m_indices[i + 0]].Position);
+			glm::vec3 p1(m_vertices[m_indices[i + 1]].Position);
+			glm::vec3 p2(m_vertices[m_indices[i + 2]].Position);
+			glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+			for (int c = 0; c < 3; ++c)
+			{
+				uint32_t v = m_indices[i + c];
+				if (vertexCorners[v].Normal == kNoIndex)
+				{
+					m_vertices[v].Normal += normal;
+				}
+			}
+		}
+		for (size_t v = 0; v < m_vertices.size(); ++v)
+		{
+			float length = glm::length(m_vertices[v].Normal);
+			if (vertexCorners[v].Normal == kNoIndex && length > 0.0f)
+			{
+				m_vertices[v].Normal /= length;
+			}
+		}
+	}
+	return true;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+/*
+  NObjParser.h
+	OBJ parser for big meshes. The file is memory mapped and split in chunks on
+	line boundaries that the workers parse in parallel, the chunks are then
+	merged using the prefix sum of their element counts. Only positions, normals,
+	uvs and faces are read, faces are triangulated as fans.
+*/
+
+#include "NModel.h"
+#include <vector>
+
+class NObjParser
+{
+public:
+	NObjParser();
+	~NObjParser();
+
+	// Vertices are deduplicated per position/uv/normal combination. If calculateNormals is set,
+	// smooth normals are generated for the face corners without one.
+	bool Parse(const char* path, bool calculateNormals, uint32_t numWorkers);
+
+	const std::vector<Vertex>& GetVertices()const;
+	const std::vector<uint32_t>& GetIndices()const;
+
+private:
+	NObjParser(const NObjParser& other);
+
+	// Indices of a face corner. Relative (negative) indices of the file are stored as
+	// local to the chunk until the chunk offsets are known.
+	struct Corner
+	{
+		int32_t Position;
+		int32_t TexCoord;
+		int32_t Normal;
+		uint32_t RelativeMask;	// Bit per index still local to the chunk
+	};
+
+	struct Chunk
+	{
+		NObjParser* Parser;
+		const char* Begin;
+		const char* End;
+		std::vector<glm::vec3> Positions;
+		std::vector<glm::vec2> TexCoords;
+		std::vector<glm::vec3> Normals;
+		std::vector<Corner> Corners;	// Three per triangle
+		uint32_t PositionOffset;
+		uint32_t TexCoordOffset;
+		uint32_t NormalOffset;
+		bool Failed;
+	};
+
+	static void ParseChunkJob(void* chunk);
+	static void ResolveChunkJob(void* chunk);
+	static bool ParseChunk(Chunk& chunk);
+	void ResolveChunk(Chunk& chunk);
+	bool BuildVertices(bool calculateNormals);
+
+	std::vector<Chunk> m_chunks;
+	std::vector<glm::vec3> m_positions;
+	std::vector<glm::vec2> m_texCoords;
+	std::vector<glm::vec3> m_normals;
+
+	std::vector<Vertex> m_vertices;
+	std::vector<uint32_t> m_indices;
+};
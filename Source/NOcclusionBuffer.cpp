@@ -0,0 +1,204 @@
+#include "NOcclusionBuffer.h"
+#include "gtc/type_precision.hpp"
+#include <assert.h>
+#include <float.h>
+#include <algorithm>
+
+NOcclusionBuffer::NOcclusionBuffer():
+	 m_width(0)
+	,m_height(0)
+{
+	Resize(kDefaultOcclusionWidth, kDefaultOcclusionHeight);
+}
+
+NOcclusionBuffer::NOcclusionBuffer(const NOcclusionBuffer& other)
+{
+	assert(false);
+}
+
+NOcclusionBuffer::~NOcclusionBuffer()
+{
+}
+
+void NOcclusionBuffer::Resize(int width, int height)
+{
+	m_width = glm::max(width, 1);
+	m_height = glm::max(height, 1);
+	m_depth.resize(m_width * m_height);
+	Clear();
+}
+
+int NOcclusionBuffer::GetWidth() const
+{
+	return m_width;
+}
+
+int NOcclusionBuffer::GetHeight() const
+{
+	return m_height;
+}
+
+void NOcclusionBuffer::Clear()
+{
+	for (uint32_t i = 0; i < m_depth.size(); ++i)
+	{
+		m_depth[i] = 1.0f;
+	}
+}
+
+const float* NOcclusionBuffer::GetDepth() const
+{
+	return m_depth.data();
+}
+
+bool NOcclusionBuffer::ToScreen(const glm::vec4& position, const glm::mat4& mvp, glm::vec3& screen) const
+{
+	glm::vec4 clip = mvp * position;
+	if (clip.w <= 0.0f || clip.z < -clip.w)
+	{
+		return false;
+	}
+
+	// Same mapping as the rasterizer, scaled to the size of the buffer
+	glm::vec3 ndc = glm::vec3(clip) / clip.w;
+	screen = glm::vec3((ndc.x * 0.5f + 0.5f) * m_width, (1.0f - (ndc.y * 0.5f + 0.5f)) * m_height, ndc.z);
+	return true;
+}
+
+void NOcclusionBuffer::DrawOccluder(const Vertex* vertices, uint32_t numVertices, const uint32_t* indices, uint32_t numIndices, const glm::mat4& mvp)
+{
+	// Every vertex is transformed once
+	m_screenVerts.resize(numVertices);
+	m_screenVertsValid.resize(numVertices);
+	for (uint32_t i = 0; i < numVertices; ++i)
+	{
+		m_screenVertsValid[i] = ToScreen(vertices[i].Position, mvp, m_screenVerts[i]);
+	}
+
+	uint32_t numCorners = indices ? numIndices : numVertices;
+	for (uint32_t i = 0; i + 2 < numCorners; i += 3)
+	{
+		uint32_t corners[3] = { i, i + 1, i + 2 };
+		if (indices)
+		{
+			corners[0] = indices[i];
+			corners[1] = indices[i + 1];
+			corners[2] = indices[i + 2];
+		}
+		// Not clipped, leaving out part of an occluder is always safe
+		if (!m_screenVertsValid[corners[0]] || !m_screenVertsValid[corners[1]] || !m_screenVertsValid[corners[2]])
+		{
+			continue;
+		}
+		glm::vec3 verts[3] = { m_screenVerts[corners[0]], m_screenVerts[corners[1]], m_screenVerts[corners[2]] };
+		RasterTriangle(verts);
+	}
+}
+
+void NOcclusionBuffer::RasterTriangle(const glm::vec3* verts)
+{
+	// Both faces are drawn, back facing ones are flipped so the edge functions are positive
+	// inside. Doubles, as vertices may be far outside of the buffer.
+	glm::dvec3 v[3] = { glm::dvec3(verts[0]), glm::dvec3(verts[1]), glm::dvec3(verts[2]) };
+	double area = (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[1].y - v[0].y) * (v[2].x - v[0].x);
+	if (area == 0.0)
+	{
+		return;
+	}
+	if (area < 0.0)
+	{
+		std::swap(v[1], v[2]);
+		area = -area;
+	}
+
+	// Edge i is opposite to vertex i, A * x + B * y + C is positive inside. C is moved to the
+	// corner of the pixel closest to the edge, so testing the center tells if all the pixel is in.
+	double edgeA[3];
+	double edgeB[3];
+	double edgeC[3];
+	for (int i = 0; i < 3; ++i)
+	{
+		const glm::dvec3& a = v[(i + 1) % 3];
+		const glm::dvec3& b = v[(i + 2) % 3];
+		edgeA[i] = a.y - b.y;
+		edgeB[i] = b.x - a.x;
+		edgeC[i] = -(edgeA[i] * a.x + edgeB[i] * a.y) - 0.5 * (glm::abs(edgeA[i]) + glm::abs(edgeB[i]));
+	}
+
+	// Farthest depth over a pixel is its center plus the half extents along the gradient,
+	// never past the farthest vertex as the pixel is inside the triangle
+	double depthX = (v[0].z * edgeA[0] + v[1].z * edgeA[1] + v[2].z * edgeA[2]) / area;
+	double depthY = (v[0].z * edgeB[0] + v[1].z * edgeB[1] + v[2].z * edgeB[2]) / area;
+	double depthOffset = 0.5 * (glm::abs(depthX) + glm::abs(depthY));
+	double maxDepth = glm::max(glm::max(v[0].z, v[1].z), v[2].z);
+
+	// Pixels overlapped by the bounds
+	double minX = glm::max(glm::min(glm::min(v[0].x, v[1].x), v[2].x), 0.0);
+	double minY = glm::max(glm::min(glm::min(v[0].y, v[1].y), v[2].y), 0.0);
+	double maxX = glm::min(glm::max(glm::max(v[0].x, v[1].x), v[2].x), (double)m_width);
+	double maxY = glm::min(glm::max(glm::max(v[0].y, v[1].y), v[2].y), (double)m_height);
+	for (int y = (int)minY; y < (int)glm::ceil(maxY); ++y)
+	{
+		double centerY = y + 0.5;
+		for (int x = (int)minX; x < (int)glm::ceil(maxX); ++x)
+		{
+			double centerX = x + 0.5;
+			double e0 = edgeA[0] * centerX + edgeB[0] * centerY + edgeC[0];
+			double e1 = edgeA[1] * centerX + edgeB[1] * centerY + edgeC[1];
+			double e2 = edgeA[2] * centerX + edgeB[2] * centerY + edgeC[2];
+			if (e0 < 0.0 || e1 < 0.0 || e2 < 0.0)
+			{
+				continue;
+			}
+
+			// The edge functions are offset, the barycentrics come from the center ones
+			double w0 = e0 + 0.5 * (glm::abs(edgeA[0]) + glm::abs(edgeB[0]));
+			double w1 = e1 + 0.5 * (glm::abs(edgeA[1]) + glm::abs(edgeB[1]));
+			double w2 = e2 + 0.5 * (glm::abs(edgeA[2]) + glm::abs(edgeB[2]));
+			double depth = (v[0].z * w0 + v[1].z * w1 + v[2].z * w2) / area;
+			float pixelDepth = (float)glm::min(depth + depthOffset, maxDepth);
+
+			float& curDepth = m_depth[y * m_width + x];
+			curDepth = glm::min(curDepth, pixelDepth);
+		}
+	}
+}
+
+bool NOcclusionBuffer::IsVisible(const AABB& bounds, const glm::mat4& mvp) const
+{
+	// Screen rect and closest depth of the corners, depth is linear so the box can't be closer
+	glm::vec2 rectMin(FLT_MAX);
+	glm::vec2 rectMax(-FLT_MAX);
+	float minDepth = FLT_MAX;
+	for (int c = 0; c < 8; ++c)
+	{
+		glm::vec4 corner((c & 1) ? bounds.Max.x : bounds.Min.x, (c & 2) ? bounds.Max.y : bounds.Min.y, (c & 4) ? bounds.Max.z : bounds.Min.z, 1.0f);
+		glm::vec3 screen;
+		if (!ToScreen(corner, mvp, screen))
+		{
+			// Crossing the near plane, it may cover anything
+			return true;
+		}
+		rectMin = glm::min(rectMin, glm::vec2(screen));
+		rectMax = glm::max(rectMax, glm::vec2(screen));
+		minDepth = glm::min(minDepth, screen.z);
+	}
+
+	// Pixels overlapped by the rect, visible as soon as one of them is behind the box
+	int minX = (int)glm::floor(glm::clamp(rectMin.x, 0.0f, (float)m_width));
+	int minY = (int)glm::floor(glm::clamp(rectMin.y, 0.0f, (float)m_height));
+	int maxX = (int)glm::floor(glm::clamp(rectMax.x, -1.0f, (float)m_width - 1.0f));
+	int maxY = (int)glm::floor(glm::clamp(rectMax.y, -1.0f, (float)m_height - 1.0f));
+	for (int y = minY; y <= maxY; ++y)
+	{
+		const float* depthRow = &m_depth[y * m_width];
+		for (int x = minX; x <= maxX; ++x)
+		{
+			if (minDepth < depthRow[x])
+			{
+				return true;
+			}
+		}
+	}
+	return false;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+/*
+  NOcclusionBuffer.h
+	Small depth only buffer to cull whole draws. Occluders are rasterized conservatively,
+	a pixel is only written if a triangle covers all of it and with the farthest depth
+	of the triangle over it. Bounding boxes are then tested with their closest depth
+	against every pixel they overlap.
+*/
+
+#include "NModel.h"
+#include <vector>
+
+static const int kDefaultOcclusionWidth = 256;
+static const int kDefaultOcclusionHeight = 128;
+
+class NOcclusionBuffer
+{
+public:
+	NOcclusionBuffer();
+	~NOcclusionBuffer();
+
+	// Covers the whole viewport whatever its size, cleared by the resize.
+	void Resize(int width, int height);
+	int GetWidth()const;
+	int GetHeight()const;
+	void Clear();
+
+	// Triangle list, null indices for non indexed ones. Both faces are drawn, triangles
+	// crossing the near plane are skipped.
+	void DrawOccluder(const Vertex* vertices, uint32_t numVertices, const uint32_t* indices, uint32_t numIndices, const glm::mat4& mvp);
+	// False if the box is fully behind the occluders or outside of the screen.
+	bool IsVisible(const AABB& bounds, const glm::mat4& mvp)const;
+
+	const float* GetDepth()const;
+
+private:
+	NOcclusionBuffer(const NOcclusionBuffer& other);
+
+	bool ToScreen(const glm::vec4& position, const glm::mat4& mvp, glm::vec3& screen)const;
+	void RasterTriangle(const glm::vec3* verts);
+
+	std::vector<float> m_depth;
+	std::vector<glm::vec3> m_screenVerts;	// Occluder vertices, reused every draw
+	std::vector<uint8_t> m_screenVertsValid;	// False for the ones in front of the near plane
+	int m_width;
+	int m_height;
+};
@@ -1,13 +1,206 @@
 #include "NRaster.h"
 #include "NProfiler.h"
+#include "NThreadPool.h"
+#include "NOcclusionBuffer.h"
 #include "tinythread.h"
 #include "SDL.h" // for debug rendering
 #include <iostream>
+#if defined(_MSC_VER)
+	#include <intrin.h>
+#else
+	#include <cpuid.h>
+#endif
 
 // #define MULTICORE
 
-NRaster::NRaster()
+static void CpuId(int info[4], int leaf, int subLeaf)
+{
+#if defined(_MSC_VER)
+	__cpuidex(info, leaf, subLeaf);
+#else
+	__cpuid_count(leaf, subLeaf, info[0], info[1], info[2], info[3]);
+#endif
+}
+
+static uint64_t ReadXCR0()
+{
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	uint32_t lo, hi;
+	__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return ((uint64_t)hi << 32) | lo;
+#endif
+}
+
+static RasterKernel::T DetectRasterKernel()
+{
+	int info[4];
+	CpuId(info, 0, 0);
+	int maxLeaf = info[0];
+
+	CpuId(info, 1, 0);
+	bool sse41 = (info[2] & (1 << 19)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+
+	// The OS must also save the YMM registers on context switches
+	bool avxEnabled = avx && osxsave && ((ReadXCR0() & 0x6) == 0x6);
+	bool avx2 = false;
+	if (avxEnabled && maxLeaf >= 7)
+	{
+		CpuId(info, 7, 0);
+		avx2 = (info[1] & (1 << 5)) != 0;
+	}
+
+	if (avx2)
+	{
+		return RasterKernel::AVX2;
+	}
+	return sse41 ? RasterKernel::SSE41 : RasterKernel::Scalar;
+}
+
+// Runs a per vertex shader as a batched one
+static void RunVertexShaderBatch(const VertexStreams& in, const VertexShaderUniforms& uniforms, ClipPositionStreams& out)
 {
+	for (uint32_t i = 0; i < in.Count; ++i)
+	{
+		Vertex vertex;
+		vertex.Position = glm::vec4(in.PositionX[i], in.PositionY[i], in.PositionZ[i], in.PositionW[i]);
+		vertex.Normal = glm::vec3(in.NormalX[i], in.NormalY[i], in.NormalZ[i]);
+		vertex.Color = glm::vec3(in.ColorR[i], in.ColorG[i], in.ColorB[i]);
+		vertex.TexCoord = glm::vec2(in.TexCoordU[i], in.TexCoordV[i]);
+
+		glm::vec4 position = uniforms.VertexShader(vertex, uniforms.RenderData);
+		out.X[i] = position.x;
+		out.Y[i] = position.y;
+		out.Z[i] = position.z;
+		out.W[i] = position.w;
+	}
+}
+
+// Turn the render state into the template arguments of NRaster::Draw
+template<typename PS, DepthTest::T kDepthTest, bool kDepthWrite>
+static void DrawWithWinding(NRaster& raster, const RenderState& state, const Vertex* vertices, uint32_t numVertices, const uint32_t* indices, uint32_t numIndices, const VertexShaderFnAdapter& vertexShader, const PS& pixelShader)
+{
+	if (state.WOrder == WindingOrder::CW)
+	{
+		raster.Draw<VertexShaderFnAdapter, PS, kDepthTest, WindingOrder::CW, kDepthWrite>(vertices, numVertices, indices, numIndices, vertexShader, pixelShader);
+	}
+	else
+	{
+		raster.Draw<VertexShaderFnAdapter, PS, kDepthTest, WindingOrder::CCW, kDepthWrite>(vertices, numVertices, indices, numIndices, vertexShader, pixelShader);
+	}
+}
+
+template<typename PS, DepthTest::T kDepthTest>
+static void DrawWithDepthWrite(NRaster& raster, const RenderState& state, const Vertex* vertices, uint32_t numVertices, const uint32_t* indices, uint32_t numIndices, const VertexShaderFnAdapter& vertexShader, const PS& pixelShader)
+{
+	if (state.DepthWrite)
+	{
+		DrawWithWinding<PS, kDepthTest, true>(raster, state, vertices, numVertices, indices, numIndices, vertexShader, pixelShader);
+	}
+	else
+	{
+		DrawWithWinding<PS, kDepthTest, false>(raster, state, vertices, numVertices, indices, numIndices, vertexShader, pixelShader);
+	}
+}
+
+template<typename PS>
+static void DrawWithDepthState(NRaster& raster, const RenderState& state, const Vertex* vertices, uint32_t numVertices, const uint32_t* indices, uint32_t numIndices, const VertexShaderFnAdapter& vertexShader, const PS& pixelShader)
+{
+	switch (state.DTest)
+	{
+	case DepthTest::Equal:
+		DrawWithDepthWrite<PS, DepthTest::Equal>(raster, state, vertices, numVertices, indices, numIndices, vertexShader, pixelShader);
+		break;
+	default:
+		DrawWithDepthWrite<PS, DepthTest::LessThan>(raster, state, vertices, numVertices, indices, numIndices, vertexShader, pixelShader);
+		break;
+	}
+}
+
+static const char* kRasterKernelNames[RasterKernel::Count] = { "Scalar", "SSE4.1", "AVX2" };
+
+// Planes of the frustum in the space mvp transforms from, inside where dot(plane, (p, 1)) >= 0.
+// The near plane is z >= -w, the same the clipper uses.
+static void ExtractFrustumPlanes(const glm::mat4& mvp, glm::vec4* planes)
+{
+	glm::vec4 rowX(mvp[0][0], mvp[1][0], mvp[2][0], mvp[3][0]);
+	glm::vec4 rowY(mvp[0][1], mvp[1][1], mvp[2][1], mvp[3][1]);
+	glm::vec4 rowZ(mvp[0][2], mvp[1][2], mvp[2][2], mvp[3][2]);
+	glm::vec4 rowW(mvp[0][3], mvp[1][3], mvp[2][3], mvp[3][3]);
+	planes[0] = rowW + rowX;	// Left
+	planes[1] = rowW - rowX;	// Right
+	planes[2] = rowW + rowY;	// Bottom
+	planes[3] = rowW - rowY;	// Top
+	planes[4] = rowW + rowZ;	// Near
+	planes[5] = rowW - rowZ;	// Far
+}
+
+static bool IsOutsideFrustum(const glm::mat4& mvp, const AABB& box, const BoundingSphere& sphere)
+{
+	glm::vec4 planes[6];
+	ExtractFrustumPlanes(mvp, planes);
+	for (int i = 0; i < 6; ++i)
+	{
+		// Planes are not normalized, scale the radius instead
+		glm::vec3 normal = glm::vec3(planes[i]);
+		float distance = glm::dot(normal, sphere.Center) + planes[i].w;
+		float radius = sphere.Radius * glm::length(normal);
+		if (distance < -radius)
+		{
+			return true;
+		}
+
+		// The sphere crosses the plane, test the corner of the box furthest along the normal
+		if (distance < radius)
+		{
+			glm::vec3 corner(normal.x >= 0.0f ? box.Max.x : box.Min.x, normal.y >= 0.0f ? box.Max.y : box.Min.y, normal.z >= 0.0f ? box.Max.z : box.Min.z);
+			if (glm::dot(normal, corner) + planes[i].w < 0.0f)
+			{
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+static inline glm::i64vec2 ToFixed(const glm::vec4& p)
+{
+	return glm::i64vec2((int64_t)glm::floor(p.x * kSubPixelSteps + 0.5f), (int64_t)glm::floor(p.y * kSubPixelSteps + 0.5f));
+}
+
+NRaster::NRaster():
+	 m_numBinsWidth(0)
+	,m_numBinsHeight(0)
+	,m_binWidth(kDefaultTileSize)
+	,m_binHeight(kDefaultTileSize)
+	,m_frames(1)
+	,m_curFrame(0)
+	,m_frameIndex(0)
+	,m_frameActive(false)
+	,m_threadPool(nullptr)
+	,m_occlusionBuffer(new NOcclusionBuffer)
+	,m_hasDrawBounds(false)
+	,m_numVisibilityDraws(0)
+	,m_supportedKernel(RasterKernel::Scalar)
+{
+	m_renderState.Kernel = RasterKernel::Scalar;
+	m_renderState.DTest = DepthTest::LessThan;
+	m_renderState.DepthWrite = true;
+	m_renderState.HiZ.BlockMaxDepth = nullptr;
+	m_renderState.HiZ.TileMaxDepth = nullptr;
+	m_renderState.HiZ.NumBlocksWidth = 0;
+	m_renderState.HiZ.NumTilesWidth = 0;
+	m_renderState.HiZ.BlocksPerTile = 0;
+	m_renderState.WOrder = WindingOrder::CCW;
+	m_renderState.VertexShader = nullptr;
+	m_renderState.VertexBatchShader = nullptr;
+	m_renderState.PixelShader = nullptr;
+	m_renderState.PixelShaderObject = nullptr;
+	m_renderState.VisibilityBuffer = nullptr;
+	m_renderState.DrawId = 0;
 }
 
 NRaster::NRaster(const NRaster& other)
@@ -17,6 +210,22 @@ NRaster::NRaster(const NRaster& other)
 
 NRaster::~NRaster()
 {
+	// Draws of a frame that never ended still own their pixel shaders
+	Finish();
+	std::vector<FrameDraw>& draws = m_frames[m_curFrame].Draws;
+	for (uint32_t i = 0; i < draws.size(); ++i)
+	{
+		if (draws[i].OwnsPixelShader)
+		{
+			draws[i].Pipeline.DeletePixelShader((void*)draws[i].Pipeline.PixelShader);
+		}
+	}
+	for (uint32_t i = 0; i < m_numVisibilityDraws; ++i)
+	{
+		m_visibilityDraws[i].DeletePixelShader(m_visibilityDraws[i].PixelShader);
+	}
+	delete m_threadPool;
+	delete m_occlusionBuffer;
 }
 
 NRaster* NRaster::Instance()
@@ -34,20 +243,105 @@ bool NRaster::Initialize()
 	uint32_t numCores = tthread::thread::hardware_concurrency();
 	std::cout << "[NRaster][Initialize][Info]: The number of detected CPU cores is: " << numCores << std::endl;
 
-	m_numBinsHeight = numCores;
-	m_numBinsWidth = numCores;
+	// Workers are kept alive for the whole run, a draw only pushes jobs to them
+	SetNumWorkers(numCores);
 
-	m_bins = new std::vector<BinnedTriangle>[m_numBinsWidth * m_numBinsHeight];
+	// Pick the widest pixel kernel the CPU can run
+	m_supportedKernel = DetectRasterKernel();
+	m_renderState.Kernel = m_supportedKernel;
+	std::cout << "[NRaster][Initialize][Info]: Using the " << kRasterKernelNames[m_supportedKernel] << " raster kernel." << std::endl;
 
 	return false;
 }
 
+void NRaster::SetNumWorkers(uint32_t numWorkers)
+{
+	if (m_threadPool)
+	{
+		RasterFrameDraws();
+		Finish();
+		delete m_threadPool;
+	}
+	m_threadPool = new NThreadPool;
+	m_threadPool->Initialize(numWorkers);
+}
+
+uint32_t NRaster::GetNumWorkers() const
+{
+	return m_threadPool ? m_threadPool->GetNumWorkers() : 0;
+}
+
+float NRaster::GetWorkerBusyTimeMS(uint32_t worker) const
+{
+	return m_threadPool->GetBusyTimeMS(worker);
+}
+
+void NRaster::ResetWorkerStats()
+{
+	m_threadPool->ResetStats();
+}
+
+void NRaster::SetRasterKernel(RasterKernel::T kernel)
+{
+	if (kernel > m_supportedKernel)
+	{
+		std::cout << "[NRaster][SetRasterKernel][Warning]: " << kRasterKernelNames[kernel] << " is not supported, using " << kRasterKernelNames[m_supportedKernel] << ". \n";
+		kernel = m_supportedKernel;
+	}
+	m_renderState.Kernel = kernel;
+}
+
+RasterKernel::T NRaster::GetRasterKernel() const
+{
+	return m_renderState.Kernel;
+}
+
+const RasterStats& NRaster::GetStats() const
+{
+	return m_stats;
+}
+
+void NRaster::ResetStats()
+{
+	m_stats = RasterStats();
+}
+
+void NRaster::SetTileSize(int tileSize)
+{
+	// Whole blocks, so every block of the Hi-Z is owned by a single tile
+	tileSize = (glm::max(tileSize, kRasterBlockSize) + kRasterBlockSize - 1) & ~(kRasterBlockSize - 1);
+	RasterFrameDraws();
+	m_binWidth = tileSize;
+	m_binHeight = tileSize;
+	m_renderState.HiZ.BlockMaxDepth = nullptr;
+	ResizeBins();
+}
+
+int NRaster::GetTileSize() const
+{
+	return m_binWidth;
+}
+
 void NRaster::SetViewport(int x, int y, int w, int h)
 {
+	RasterFrameDraws();
 	m_renderState.ScreenRect = glm::vec4(x, y, w, h);
+	m_renderState.HiZ.BlockMaxDepth = nullptr;
+	ResizeBins();
+}
+
+void NRaster::ResizeBins()
+{
+	// Tiles have a fixed size, the ones on the right and bottom borders may be partially outside
+	int numBinsWidth = (m_renderState.ScreenRect.z + m_binWidth - 1) / m_binWidth;
+	int numBinsHeight = (m_renderState.ScreenRect.w + m_binHeight - 1) / m_binHeight;
+	if (numBinsWidth == m_numBinsWidth && numBinsHeight == m_numBinsHeight)
+	{
+		return;
+	}
 
-	m_binWidth = w / m_numBinsWidth;
-	m_binHeight = h / m_numBinsHeight;
+	m_numBinsWidth = numBinsWidth;
+	m_numBinsHeight = numBinsHeight;
 }
 
 void NRaster::SetRenderTarget(PixelRGBA32* data)
@@ -57,127 +351,582 @@ void NRaster::SetRenderTarget(PixelRGBA32* data)
 
 void NRaster::SetDepthBuffer(float* data)
 {
+	// Unknown contents, Hi-Z is off until the next ClearDepthBuffer
+	RasterFrameDraws();
 	m_renderState.DepthBuffer = data;
+	m_renderState.HiZ.BlockMaxDepth = nullptr;
+}
+
+void NRaster::ClearDepthBuffer(float depth)
+{
+	if (!m_renderState.DepthBuffer)
+	{
+		std::cout << "[NRaster][ClearDepthBuffer][Warning]: There is no depth buffer set. \n";
+		return;
+	}
+	RasterFrameDraws();
+
+	int width = m_renderState.ScreenRect.z;
+	int height = m_renderState.ScreenRect.w;
+	for (int i = 0; i < width * height; ++i)
+	{
+		m_renderState.DepthBuffer[i] = depth;
+	}
+
+	int numBlocksWidth = (width + kRasterBlockSize - 1) / kRasterBlockSize;
+	int numBlocksHeight = (height + kRasterBlockSize - 1) / kRasterBlockSize;
+	// Owned by the frame, the tiles of the frames in flight may still be updating theirs
+	FrameData& frame = m_frames[m_curFrame];
+	frame.HiZBlocks.assign(numBlocksWidth * numBlocksHeight, depth);
+	frame.HiZTiles.assign(m_numBinsWidth * m_numBinsHeight, depth);
+
+	HiZBuffer& hiZ = m_renderState.HiZ;
+	hiZ.BlockMaxDepth = frame.HiZBlocks.data();
+	hiZ.TileMaxDepth = frame.HiZTiles.data();
+	hiZ.NumBlocksWidth = numBlocksWidth;
+	hiZ.NumTilesWidth = m_numBinsWidth;
+	hiZ.BlocksPerTile = m_binWidth / kRasterBlockSize;
+}
+
+void NRaster::SetVisibilityBuffer(VisibilityId* data)
+{
+	m_renderState.VisibilityBuffer = data;
+}
+
+void NRaster::SetDepthTest(DepthTest::T depthTest)
+{
+	m_renderState.DTest = depthTest;
+}
+
+void NRaster::SetDepthWrite(bool depthWrite)
+{
+	m_renderState.DepthWrite = depthWrite;
 }
 
 void NRaster::SetShaders(VertexShaderFn vertexShader, PixelShaderFn pixelShader)
 {
 	m_renderState.VertexShader = vertexShader;
+	m_renderState.VertexBatchShader = nullptr;
+	m_renderState.PixelShader = pixelShader;
+}
+
+void NRaster::SetShaders(VertexBatchShaderFn vertexShader, PixelShaderFn pixelShader)
+{
+	m_renderState.VertexShader = nullptr;
+	m_renderState.VertexBatchShader = vertexShader;
 	m_renderState.PixelShader = pixelShader;
 }
 
 void NRaster::Draw(Vertex* data, uint32_t numVertices)
 {
-	// Before starting a new drawcall, clear the bins. This #ISNT thread safe
-	for (int by = 0; by < m_numBinsHeight; ++by)
+	DrawShaderFunctions(data, numVertices, nullptr, numVertices);
+}
+
+void NRaster::DrawIndexed(const Vertex* vertices, uint32_t numVertices, const uint32_t* indices, uint32_t numIndices)
+{
+	DrawShaderFunctions(vertices, numVertices, indices, numIndices);
+}
+
+void NRaster::DrawShaderFunctions(const Vertex* vertices, uint32_t numVertices, const uint32_t* indices, uint32_t numIndices)
+{
+	VertexShaderFnAdapter vertexShader = { m_renderState.VertexShader, m_renderState.VertexBatchShader };
+
+	// Only the shaders are called through pointers, the state picks one of the instantiations
+	if (m_renderState.PixelShader)
 	{
-		for (int bx = 0; bx < m_numBinsWidth; ++bx)
+		PixelShaderFnAdapter pixelShader = { m_renderState.PixelShader };
+		DrawWithDepthState(*this, m_renderState, vertices, numVertices, indices, numIndices, vertexShader, pixelShader);
+	}
+	else
+	{
+		DrawWithDepthState(*this, m_renderState, vertices, numVertices, indices, numIndices, vertexShader, NoPixelShader());
+	}
+}
+
+void NRaster::DrawTriangles(const Vertex* vertices, uint32_t numVertices, const uint32_t* indices, uint32_t numCorners, const DrawPipeline& pipeline)
+{
+	VertexShaderUniforms uniforms;
+	uniforms.RenderData.Projection = m_curProjection;
+	uniforms.RenderData.View = m_curView;
+	uniforms.RenderData.Transform = m_curTransform;
+	uniforms.ModelViewProjection = m_curProjection * m_curView * m_curTransform;
+	uniforms.VertexShader = m_renderState.VertexShader;
+	m_renderState.PixelShaderObject = pipeline.PixelShader;
+
+	// Whole draws off screen or hidden behind the occluders are skipped before any vertex work
+	if (m_hasDrawBounds)
+	{
+		if (IsOutsideFrustum(uniforms.ModelViewProjection, m_drawBounds, m_drawSphere))
+		{
+			++m_stats.DrawsFrustumCulled;
+			return;
+		}
+		if (!m_occlusionBuffer->IsVisible(m_drawBounds, uniforms.ModelViewProjection))
 		{
-			m_bins[by * m_numBinsWidth + bx].clear();
+			++m_stats.DrawsOcclusionCulled;
+			return;
 		}
 	}
 
-	int width = m_renderState.ScreenRect.z;
-	int height = m_renderState.ScreenRect.w;
+	// Indexed draws shade every vertex once before assembling the triangles
+	glm::vec4* clipPositions = nullptr;
+	if (indices)
+	{
+		m_clipPositions.resize(numVertices);
+		clipPositions = m_clipPositions.data();
+	}
+
+	// Guard band in clip space, triangles inside of it are rasterized without x/y clipping
+	glm::vec2 guardBand(1.0f + 2.0f * kGuardBandPixels / m_renderState.ScreenRect.z, 1.0f + 2.0f * kGuardBandPixels / m_renderState.ScreenRect.w);
+
+#if defined(MULTICORE)
+	// Split the triangles between the workers, each chunk bins its triangles on its own lists.
+	// Small draws are not worth splitting.
+	uint32_t numTriangles = numCorners / 3;
+	uint32_t numChunks = (numTriangles + kMinTrianglesPerGeometryJob - 1) / kMinTrianglesPerGeometryJob;
+	numChunks = glm::max(glm::min(numChunks, m_threadPool->GetNumWorkers()), 1u);
+	uint32_t trianglesPerChunk = (numTriangles + numChunks - 1) / numChunks;
+	uint32_t verticesPerChunk = (numVertices + numChunks - 1) / numChunks;
+
+	// The chunks of the draw go after the ones of the draws already recorded this frame. Jobs
+	// never hold a context of the frame being recorded between draws, so growing it here is safe.
+	FrameData& frame = m_frames[m_curFrame];
+	int numBins = m_numBinsWidth * m_numBinsHeight;
+	uint32_t firstChunk = frame.NumGeometryContexts;
+	if (frame.GeometryContexts.size() < firstChunk + numChunks)
+	{
+		frame.GeometryContexts.resize(firstChunk + numChunks);
+	}
+	for (uint32_t c = 0; c < numChunks; ++c)
+	{
+		GeometryContext& context = frame.GeometryContexts[firstChunk + c];
+		context.Raster = this;
+		context.Vertices = vertices;
+		context.NumVertices = numVertices;
+		context.Indices = indices;
+		context.FirstCorner = glm::min(c * trianglesPerChunk, numTriangles) * 3;
+		context.LastCorner = glm::min((c + 1) * trianglesPerChunk, numTriangles) * 3;
+		context.Pipeline = &pipeline;
+		context.Uniforms = &uniforms;
+		context.ClipPositions = clipPositions;
+		context.FirstVertex = glm::min(c * verticesPerChunk, numVertices);
+		context.LastVertex = glm::min((c + 1) * verticesPerChunk, numVertices);
+		context.GuardBand = guardBand;
+		context.Triangles.clear();
+		context.FirstTriangleId = 0;
+		context.Stats = RasterStats();
+		context.Bins.resize(numBins);
+		for (int b = 0; b < numBins; ++b)
+		{
+			context.Bins[b].clear();
+		}
+	}
+	// Only the geometry jobs are waited, tiles of the frames in flight keep going
+	GeometryContext* chunks = &frame.GeometryContexts[firstChunk];
+	if (indices)
+	{
+		for (uint32_t c = 0; c < numChunks; ++c)
+		{
+			m_threadPool->Submit(pipeline.ShadeVerticesJob, (void*)&chunks[c], &m_geometryJobs);
+		}
+		m_threadPool->Wait(m_geometryJobs);
+	}
+	for (uint32_t c = 0; c < numChunks; ++c)
+	{
+		m_threadPool->Submit(pipeline.ProcessGeometryJob, (void*)&chunks[c], &m_geometryJobs);
+	}
+	m_threadPool->Wait(m_geometryJobs);
+	uint32_t numDrawTriangles = 0;
+	for (uint32_t c = 0; c < numChunks; ++c)
+	{
+		m_stats.Add(chunks[c].Stats);
+		numDrawTriangles += (uint32_t)chunks[c].Triangles.size();
+	}
+	if (numDrawTriangles == 0)
+	{
+		return;
+	}
+
+	// The triangle ids of each chunk start after the ones of the previous chunks
+	if (pipeline.Visibility)
+	{
+		for (uint32_t c = 1; c < numChunks; ++c)
+		{
+			chunks[c].FirstTriangleId = chunks[c - 1].FirstTriangleId + (uint32_t)chunks[c - 1].Triangles.size();
+		}
+		for (uint32_t c = 0; c < numChunks; ++c)
+		{
+			std::vector<TriangleSetup>& triangles = chunks[c].Triangles;
+			pipeline.Visibility->Triangles.insert(pipeline.Visibility->Triangles.end(), triangles.begin(), triangles.end());
+		}
+	}
+
+	// Recorded with the state it was submitted with. Inside a frame the tiles raster it at
+	// EndFrame, by then the pixel shader of the draw is gone so it is copied.
+	FrameDraw draw;
+	draw.Pipeline = pipeline;
+	draw.State = m_renderState;
+	draw.FirstGeometryContext = firstChunk;
+	draw.NumGeometryContexts = numChunks;
+	draw.OwnsPixelShader = m_frameActive;
+	if (draw.OwnsPixelShader)
+	{
+		draw.Pipeline.PixelShader = pipeline.ClonePixelShader(pipeline.PixelShader);
+		draw.State.PixelShaderObject = draw.Pipeline.PixelShader;
+	}
+	frame.Draws.push_back(draw);
+	frame.NumGeometryContexts += numChunks;
+	if (!m_frameActive)
+	{
+		RasterFrameDraws();
+	}
+#else
+	m_renderState.RtSize = m_renderState.ScreenRect; // the size of the rt should be inside the texture
+
+	GeometryContext context;
+	context.Raster = this;
+	context.Vertices = vertices;
+	context.NumVertices = numVertices;
+	context.Indices = indices;
+	context.FirstCorner = 0;
+	context.LastCorner = numCorners - numCorners % 3;
+	context.Pipeline = &pipeline;
+	context.Uniforms = &uniforms;
+	context.ClipPositions = clipPositions;
+	context.FirstVertex = 0;
+	context.LastVertex = numVertices;
+	context.GuardBand = guardBand;
+	context.FirstTriangleId = 0;
+	if (indices)
+	{
+		pipeline.ShadeVerticesJob(&context);
+	}
+	pipeline.ProcessGeometryJob(&context);
+	m_stats.Add(context.Stats);
+	if (pipeline.Visibility)
+	{
+		pipeline.Visibility->Triangles.swap(context.Triangles);
+	}
+#endif
+}
+
+template<>
+void NRaster::ShadeVertices<VertexShaderFnAdapter>(GeometryContext& context, const Vertex* vertices, uint32_t numVertices, glm::vec4* outPositions) const
+{
+	const VertexShaderFnAdapter& adapter = *(const VertexShaderFnAdapter*)context.Pipeline->VertexShader;
+	VertexBatchShaderFn shader = adapter.VertexBatchShader ? adapter.VertexBatchShader : RunVertexShaderBatch;
 
-	VertexRenderData vtxRenderData;
-	vtxRenderData.Projection = m_curProjection;
-	vtxRenderData.View = m_curView;
-	vtxRenderData.Transform = m_curTransform;
+	alignas(32) float in[12][kVertexBatchSize];
+	alignas(32) float out[4][kVertexBatchSize];
+	VertexStreams streams = { in[0], in[1], in[2], in[3], in[4], in[5], in[6], in[7], in[8], in[9], in[10], in[11], 0 };
+	ClipPositionStreams positions = { out[0], out[1], out[2], out[3] };
 
-	uint64_t acumCycles = 0;
-	for (uint32_t i = 0; i < numVertices; i += 3)
+	for (uint32_t first = 0; first < numVertices; first += kVertexBatchSize)
 	{
-		BinnedTriangle triangle;
-		triangle.Verts[0] = data[i + 0];
-		triangle.Verts[1] = data[i + 2];
-		triangle.Verts[2] = data[i + 1];
+		// AoS to SoA
+		streams.Count = glm::min(kVertexBatchSize, numVertices - first);
+		for (uint32_t i = 0; i < streams.Count; ++i)
+		{
+			const Vertex& vertex = vertices[first + i];
+			in[0][i] = vertex.Position.x;
+			in[1][i] = vertex.Position.y;
+			in[2][i] = vertex.Position.z;
+			in[3][i] = vertex.Position.w;
+			in[4][i] = vertex.Normal.x;
+			in[5][i] = vertex.Normal.y;
+			in[6][i] = vertex.Normal.z;
+			in[7][i] = vertex.Color.r;
+			in[8][i] = vertex.Color.g;
+			in[9][i] = vertex.Color.b;
+			in[10][i] = vertex.TexCoord.x;
+			in[11][i] = vertex.TexCoord.y;
+		}
+
+		shader(streams, *context.Uniforms, positions);
 
-		// Vertex shader:
-		triangle.Verts[0].Position = m_renderState.VertexShader(triangle.Verts[0], vtxRenderData);
-		triangle.Verts[1].Position = m_renderState.VertexShader(triangle.Verts[1], vtxRenderData);
-		triangle.Verts[2].Position = m_renderState.VertexShader(triangle.Verts[2], vtxRenderData);
+		for (uint32_t i = 0; i < streams.Count; ++i)
+		{
+			outPositions[first + i] = glm::vec4(out[0][i], out[1][i], out[2][i], out[3][i]);
+		}
+	}
+	context.Stats.VertexShaderInvocations += numVertices;
+}
+
+void NRaster::ProcessTriangle(Vertex* clipVerts, GeometryContext& context) const
+{
+	// Clip:
+	uint32_t outcodes[3];
+	outcodes[0] = ComputeOutcode(clipVerts[0].Position, context.GuardBand);
+	outcodes[1] = ComputeOutcode(clipVerts[1].Position, context.GuardBand);
+	outcodes[2] = ComputeOutcode(clipVerts[2].Position, context.GuardBand);
+
+	// All the vertices outside the same frustum plane
+	if ((outcodes[0] & outcodes[1] & outcodes[2] & ClipPlane::FrustumMask) != 0)
+	{
+		++context.Stats.TrianglesClipRejected;
+		return;
+	}
+
+	// Only the near plane and the guard band need real clipping
+	uint32_t clipPlanes = (outcodes[0] | outcodes[1] | outcodes[2]) & ClipPlane::ClipMask;
+	if (clipPlanes == 0)
+	{
+		++context.Stats.TrianglesClipPassed;
+		SubmitTriangle(clipVerts, context);
+		return;
+	}
+
+	++context.Stats.TrianglesClipped;
+	Vertex polygon[kMaxClipVertices];
+	uint32_t numPolygonVerts = ClipTriangle(clipVerts, clipPlanes, context.GuardBand, polygon);
+	for (uint32_t p = 2; p < numPolygonVerts; ++p)
+	{
+		Vertex fanVerts[3] = { polygon[0], polygon[p - 1], polygon[p] };
+		SubmitTriangle(fanVerts, context);
+	}
+}
+
+void NRaster::SubmitTriangle(const Vertex* clipVerts, GeometryContext& context) const
+{
+	int width = m_renderState.ScreenRect.z;
+	int height = m_renderState.ScreenRect.w;
+
+	Vertex screenVerts[3];
+	for (int v = 0; v < 3; ++v)
+	{
+		screenVerts[v] = clipVerts[v];
 
 		// Normalize:
-		triangle.Verts[0].Position /= triangle.Verts[0].Position.w;
-		triangle.Verts[1].Position /= triangle.Verts[1].Position.w;
-		triangle.Verts[2].Position /= triangle.Verts[2].Position.w;
+		glm::vec4 ndc = clipVerts[v].Position / clipVerts[v].Position.w;
+
+		// Convert to screen position, keep 1 / w for perspective correct interpolation
+		screenVerts[v].Position = glm::vec4((ndc.x * 0.5f + 0.5f) * width, (1.0f - (ndc.y * 0.5f + 0.5f)) * height, ndc.z, 1.0f / clipVerts[v].Position.w);
+	}
 
-		// Convert to screen position
-		triangle.Verts[0].Position = glm::vec4((triangle.Verts[0].Position.x * 0.5f + 0.5f) * width, (1.0f - (triangle.Verts[0].Position.y * 0.5f + 0.5f)) * height, triangle.Verts[0].Position.z, 1.0f);
-		triangle.Verts[1].Position = glm::vec4((triangle.Verts[1].Position.x * 0.5f + 0.5f) * width, (1.0f - (triangle.Verts[1].Position.y * 0.5f + 0.5f)) * height, triangle.Verts[1].Position.z, 1.0f);
-		triangle.Verts[2].Position = glm::vec4((triangle.Verts[2].Position.x * 0.5f + 0.5f) * width, (1.0f - (triangle.Verts[2].Position.y * 0.5f + 0.5f)) * height, triangle.Verts[2].Position.z, 1.0f);
+	// Cull back facing, degenerated and off screen triangles here, before copying them to any bin
+	TriangleSetup setup;
+	if (!SetupTriangle(screenVerts, setup) || !IsSpanVisible(setup.Bounds, m_renderState.ScreenRect))
+	{
+		++context.Stats.TrianglesCulled;
+		return;
+	}
+	if (context.Pipeline->NeedsAttributes)
+	{
+		SetupAttributes(screenVerts, setup);
+	}
 
-		// Min depth
-		triangle.MinDepth = glm::min(glm::min(triangle.Verts[0].Position.z, triangle.Verts[1].Position.z), triangle.Verts[2].Position.z);
+	// Written once to the triangles of the chunk, the bins only keep its id. Single core only
+	// keeps them for visibility buffer draws, they are needed again by the resolve.
+	uint32_t triangleId = (uint32_t)context.Triangles.size();
+#if defined(MULTICORE)
+	context.Triangles.push_back(setup);
+#else
+	if (context.Pipeline->Visibility)
+	{
+		context.Triangles.push_back(setup);
+	}
+#endif
 
-		// Add to bin:
+	// Add to bin:
 #if defined(MULTICORE)
-		int binWidth = width / m_numBinsWidth;
-		int binHeight = height / m_numBinsHeight;
-		glm::vec3 p0(triangle.Verts[0].Position.x, triangle.Verts[0].Position.y,0.0f);
-		glm::vec3 p1(triangle.Verts[1].Position.x, triangle.Verts[1].Position.y,0.0f);
-		glm::vec3 p2(triangle.Verts[2].Position.x, triangle.Verts[2].Position.y,0.0f);
-		glm::vec4 triBounds = GetBounds(p0, p1, p2);
-		for (int by = 0; by < m_numBinsHeight; ++by)
+	// Bins overlapped by the pixel bounds of the triangle
+	int minBinX = glm::max(setup.Bounds.x, 0) / m_binWidth;
+	int minBinY = glm::max(setup.Bounds.y, 0) / m_binHeight;
+	int maxBinX = glm::min(setup.Bounds.z / m_binWidth, m_numBinsWidth - 1);
+	int maxBinY = glm::min(setup.Bounds.w / m_binHeight, m_numBinsHeight - 1);
+
+	// A single row or column of bins is already tight. Otherwise, long thin triangles cross
+	// bins that only touch their bounds, test the edges against the bin corners to skip them.
+	bool testEdges = minBinX != maxBinX && minBinY != maxBinY;
+	for (int by = minBinY; by <= maxBinY; ++by)
+	{
+		for (int bx = minBinX; bx <= maxBinX; ++bx)
 		{
-			for (int bx = 0; bx < m_numBinsWidth; ++bx)
+			if (testEdges)
 			{
-				float x = bx * binWidth;
-				float y = by * binHeight;
-				glm::vec4 bquad = glm::vec4(x, y, x + binWidth, y + binHeight);
-				if (RectInsideRect(bquad, triBounds))
+				glm::ivec4 binSpan;
+				binSpan.x = glm::max(bx * m_binWidth, setup.Bounds.x);
+				binSpan.y = glm::max(by * m_binHeight, setup.Bounds.y);
+				binSpan.z = glm::min((bx + 1) * m_binWidth - 1, setup.Bounds.z);
+				binSpan.w = glm::min((by + 1) * m_binHeight - 1, setup.Bounds.w);
+				if (ClassifyBlock(setup, binSpan) == BlockCoverage::Outside)
 				{
-					m_bins[by * m_numBinsWidth + bx].push_back(triangle);
+					continue;
 				}
-
 			}
+			context.Bins[by * m_numBinsWidth + bx].push_back(triangleId);
+			++context.Stats.TrianglesBinned;
 		}
+	}
 #else
-		auto tstart = NProfilerGet()->Now();
-
-		// Raster triangle:
-		m_renderState.RtSize = m_renderState.ScreenRect; // the size of the rt should be inside the texture
-		NRaster::RasterTriangle(m_renderState, triangle.Verts);
+	// Skip it if it is behind all the tiles it overlaps
+	if (IsHiZOccluded(m_renderState, context.Pipeline->DTest, setup.MinDepth, setup.Bounds))
+	{
+		++context.Stats.TrianglesHiZCulled;
+		return;
+	}
 
-		auto tend = NProfilerGet()->Now();
-		acumCycles += NProfilerGet()->TimeMSToCycles(NProfilerGet()->TimeDiffMS(tstart, tend));
+	// Raster triangle:
+	context.Pipeline->Raster(m_renderState, setup, context.FirstTriangleId + triangleId, context.Stats);
 #endif
-	}
-	
-	//uint64_t avgCycles = acumCycles / numVertices;
-	//std::cout << "[NRaster::Draw] " << avgCycles << std::endl;
+}
 
-	// Schedule jobs
-#if defined(MULTICORE)
-	std::vector<tthread::thread*> debugThreads;
-	std::vector<RasterContextMT*> threadContexts;
-	for (int by = 0; by < m_numBinsHeight; ++by)
+uint32_t NRaster::ComputeOutcode(const glm::vec4& p, const glm::vec2& guardBand)
+{
+	uint32_t outcode = 0;
+	outcode |= (p.x < -p.w) ? ClipPlane::Left : 0;
+	outcode |= (p.x > p.w) ? ClipPlane::Right : 0;
+	outcode |= (p.y < -p.w) ? ClipPlane::Bottom : 0;
+	outcode |= (p.y > p.w) ? ClipPlane::Top : 0;
+	outcode |= (p.z < -p.w) ? ClipPlane::Near : 0;
+	outcode |= (p.z > p.w) ? ClipPlane::Far : 0;
+	outcode |= (p.x < -guardBand.x * p.w) ? ClipPlane::GuardLeft : 0;
+	outcode |= (p.x > guardBand.x * p.w) ? ClipPlane::GuardRight : 0;
+	outcode |= (p.y < -guardBand.y * p.w) ? ClipPlane::GuardBottom : 0;
+	outcode |= (p.y > guardBand.y * p.w) ? ClipPlane::GuardTop : 0;
+	return outcode;
+}
+
+uint32_t NRaster::ClipTriangle(const Vertex* clipVerts, uint32_t clipPlanes, const glm::vec2& guardBand, Vertex* outPolygon)
+{
+	// Sutherland-Hodgman against each plane, inside when dot(plane, position) >= 0
+	Vertex buffers[2][kMaxClipVertices];
+	Vertex* input = buffers[0];
+	Vertex* output = buffers[1];
+	uint32_t numInput = 3;
+	input[0] = clipVerts[0];
+	input[1] = clipVerts[1];
+	input[2] = clipVerts[2];
+
+	const uint32_t planeIds[5] = { ClipPlane::Near, ClipPlane::GuardLeft, ClipPlane::GuardRight, ClipPlane::GuardBottom, ClipPlane::GuardTop };
+	const glm::vec4 planes[5] =
 	{
-		for (int bx = 0; bx < m_numBinsWidth; ++bx)
+		glm::vec4(0.0f, 0.0f, 1.0f, 1.0f),
+		glm::vec4(1.0f, 0.0f, 0.0f, guardBand.x),
+		glm::vec4(-1.0f, 0.0f, 0.0f, guardBand.x),
+		glm::vec4(0.0f, 1.0f, 0.0f, guardBand.y),
+		glm::vec4(0.0f, -1.0f, 0.0f, guardBand.y)
+	};
+
+	for (int p = 0; p < 5 && numInput >= 3; ++p)
+	{
+		if ((clipPlanes & planeIds[p]) == 0)
+		{
+			continue;
+		}
+
+		uint32_t numOutput = 0;
+		for (uint32_t v = 0; v < numInput; ++v)
 		{
-			if (m_bins[by * m_numBinsWidth + bx].empty())
+			const Vertex& cur = input[v];
+			const Vertex& next = input[(v + 1) % numInput];
+			float curDist = glm::dot(planes[p], cur.Position);
+			float nextDist = glm::dot(planes[p], next.Position);
+
+			if (curDist >= 0.0f)
 			{
-				continue;
+				output[numOutput++] = cur;
 			}
-			// if ((by == 2) && (bx == 3))
+			if ((curDist >= 0.0f) != (nextDist >= 0.0f))
 			{
-				glm::vec4 threadZone(bx * m_binWidth, by * m_binHeight, m_binWidth, m_binHeight);
-				threadContexts.push_back(new RasterContextMT(m_renderState, m_bins[by * m_numBinsWidth + bx], threadZone, glm::vec4(0, 0, 1, 1)));
-				debugThreads.emplace_back(new tthread::thread(NRaster::RasterTraingleMT, (void*)threadContexts[threadContexts.size() - 1]));
+				// Attributes are linear in clip space, so we can lerp all of them
+				float t = curDist / (curDist - nextDist);
+				Vertex& clipped = output[numOutput++];
+				clipped.Position = cur.Position + (next.Position - cur.Position) * t;
+				clipped.Normal = cur.Normal + (next.Normal - cur.Normal) * t;
+				clipped.Color = cur.Color + (next.Color - cur.Color) * t;
+				clipped.TexCoord = cur.TexCoord + (next.TexCoord - cur.TexCoord) * t;
 			}
 		}
+
+		Vertex* swap = input;
+		input = output;
+		output = swap;
+		numInput = numOutput;
 	}
-	// Wait for all to be done and release memory
-	for (uint32_t tidx = 0; tidx != debugThreads.size(); ++tidx)
+
+	if (numInput < 3)
 	{
-		debugThreads[tidx]->join();
-		delete debugThreads[tidx];
-		delete threadContexts[tidx];
+		return 0;
 	}
-	debugThreads.clear();
-	threadContexts.clear();
-#endif
+	for (uint32_t v = 0; v < numInput; ++v)
+	{
+		outPolygon[v] = input[v];
+	}
+	return numInput;
+}
+
+void NRaster::BeginFrame()
+{
+	if (m_frameActive)
+	{
+		std::cout << "[NRaster][BeginFrame][Warning]: The previous frame didn't end. \n";
+		RasterFrameDraws();
+	}
+	m_frameActive = true;
+
+	// EndFrame already waited for the previous use of this one
+	FrameData& frame = m_frames[m_curFrame];
+	frame.Index = ++m_frameIndex;
+	frame.Ended = false;
+	frame.BeginTime = std::chrono::high_resolution_clock::now();
+}
+
+void NRaster::EndFrame()
+{
+	if (!m_frameActive)
+	{
+		std::cout << "[NRaster][EndFrame][Warning]: There is no frame to end. \n";
+		return;
+	}
+	m_frameActive = false;
+
+	FrameData& frame = m_frames[m_curFrame];
+	frame.Ended = true;
+	frame.EndTime = std::chrono::high_resolution_clock::now();
+	SubmitTiles(frame);
+
+	// The next frame is recorded on the oldest one, it has to be done first. With a single frame
+	// in flight that is the one just submitted.
+	m_curFrame = (m_curFrame + 1) % m_frames.size();
+	CompleteFrame(m_frames[m_curFrame]);
+	if (m_frames.size() > 1)
+	{
+		// Its Hi-Z belongs to the frame in flight
+		m_renderState.HiZ.BlockMaxDepth = nullptr;
+	}
+}
+
+void NRaster::SetMaxFramesInFlight(uint32_t numFrames)
+{
+	if (m_frameActive)
+	{
+		std::cout << "[NRaster][SetMaxFramesInFlight][Warning]: Can't be changed inside a frame. \n";
+		return;
+	}
+	Finish();
+	m_frames.resize(glm::clamp(numFrames, 1u, kMaxFramesInFlight));
+	m_curFrame = 0;
+	m_renderState.HiZ.BlockMaxDepth = nullptr;
+}
+
+uint32_t NRaster::GetMaxFramesInFlight() const
+{
+	return (uint32_t)m_frames.size();
+}
+
+void NRaster::Finish()
+{
+	// Oldest first, so the timings are of the last frame
+	for (uint32_t i = 1; i <= m_frames.size(); ++i)
+	{
+		CompleteFrame(m_frames[(m_curFrame + i) % m_frames.size()]);
+	}
+}
+
+const FrameTimings& NRaster::GetLastFrameTimings() const
+{
+	return m_lastFrameTimings;
 }
 
 void NRaster::SetTransforms(glm::mat4 transform, glm::mat4 view, glm::mat4 projection)
@@ -187,6 +936,46 @@ void NRaster::SetTransforms(glm::mat4 transform, glm::mat4 view, glm::mat4 proje
 	m_curProjection = projection;
 }
 
+void NRaster::SetOcclusionBufferSize(int width, int height)
+{
+	m_occlusionBuffer->Resize(width, height);
+}
+
+void NRaster::ClearOccluders()
+{
+	m_occlusionBuffer->Clear();
+}
+
+void NRaster::DrawOccluder(const Vertex* vertices, uint32_t numVertices, const uint32_t* indices, uint32_t numIndices)
+{
+	m_occlusionBuffer->DrawOccluder(vertices, numVertices, indices, numIndices, m_curProjection * m_curView * m_curTransform);
+}
+
+bool NRaster::IsVisible(const AABB& bounds, const glm::mat4& mvp) const
+{
+	return m_occlusionBuffer->IsVisible(bounds, mvp);
+}
+
+void NRaster::SetDrawBounds(const AABB* bounds, const BoundingSphere* sphere)
+{
+	m_hasDrawBounds = bounds != nullptr;
+	if (!bounds)
+	{
+		return;
+	}
+
+	m_drawBounds = *bounds;
+	if (sphere)
+	{
+		m_drawSphere = *sphere;
+	}
+	else
+	{
+		m_drawSphere.Center = (bounds->Min + bounds->Max) * 0.5f;
+		m_drawSphere.Radius = glm::length(bounds->Max - bounds->Min) * 0.5f;
+	}
+}
+
 void NRaster::DebugDraw(SDL_Renderer* renderer)
 {
 	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0xff);
@@ -202,145 +991,287 @@ void NRaster::DebugDraw(SDL_Renderer* renderer)
 	}
 }
 
-inline float NRaster::EdgeTest(const glm::vec3& a, const glm::vec3& b, const glm::vec3& c)
+void NRaster::SetupEdge(const glm::i64vec2& a, const glm::i64vec2& b, TriangleEdge& edge)
 {
-	return ((c.x - a.x) * (b.y - a.y) - (c.y - a.y) * (b.x - a.x));
+	// E(p) = (p.x - a.x) * (b.y - a.y) - (p.y - a.y) * (b.x - a.x) = A * p.x + B * p.y + C
+	// Snapped coordinates are below 2^20 sub pixels, their differences fit in 32 bits
+	edge.A = (int32_t)(b.y - a.y);
+	edge.B = (int32_t)(a.x - b.x);
+	edge.C = a.y * b.x - a.x * b.y;
+
+	// Top-left fill rule: pixels exactly on an edge only belong to the triangle if it is
+	// a left edge or a top one. Biasing the rest lets us test E >= 0 for all of them.
+	bool isTopLeft = (edge.A > 0) || (edge.A == 0 && edge.B > 0);
+	if (!isTopLeft)
+	{
+		edge.C -= 1;
+	}
 }
 
-void NRaster::RasterTriangle(const RenderState& renderState, Vertex* vtx)
+bool NRaster::SetupTriangle(const Vertex* vtx, TriangleSetup& setup)
 {
-	int width = renderState.RtSize.z;
-	int height = renderState.RtSize.w;
-	PixelRGBA32* pixels = renderState.RenderTarget;
-	float* depthBuffer = renderState.DepthBuffer;
+	// Triangles outside the representable range can't be snapped
+	for (int i = 0; i < 3; ++i)
+	{
+		if (glm::abs(vtx[i].Position.x) > kMaxRasterCoord || glm::abs(vtx[i].Position.y) > kMaxRasterCoord)
+		{
+			return false;
+		}
+	}
 
-	// [CCW] already in raster space
-	glm::vec3 rasterv0 = vtx[0].Position;
-	glm::vec3 rasterv1 = vtx[1].Position;
-	glm::vec3 rasterv2 = vtx[2].Position;
+	// [CCW] already in raster space, snap to the sub pixel grid
+	glm::i64vec2 fixedv0 = ToFixed(vtx[0].Position);
+	glm::i64vec2 fixedv1 = ToFixed(vtx[1].Position);
+	glm::i64vec2 fixedv2 = ToFixed(vtx[2].Position);
 
-	// Pre calc 1 over area of the tri:
-	float areaRcp = 1.0f / EdgeTest(rasterv0, rasterv1, rasterv2);
-	// Skip back facing triangles:
-	if (areaRcp <= 0.0f)
+	// Twice the area of the tri. Skip back facing and degenerated triangles:
+	int64_t area = (fixedv0.x - fixedv1.x) * (fixedv2.y - fixedv1.y) - (fixedv0.y - fixedv1.y) * (fixedv2.x - fixedv1.x);
+	if (area <= 0)
 	{
-		return;
+		return false;
+	}
+
+	// Edges opposite to each vertex, so E0 is the weight of v0 etc.
+	SetupEdge(fixedv1, fixedv2, setup.Edges[0]);
+	SetupEdge(fixedv2, fixedv0, setup.Edges[1]);
+	SetupEdge(fixedv0, fixedv1, setup.Edges[2]);
+
+	// The edges always add up to the area minus the fill rule bias. Normalize by that sum
+	// so the weights add up to one, tiny triangles would interpolate a too close depth otherwise.
+	int64_t edgeSum = setup.Edges[0].C + setup.Edges[1].C + setup.Edges[2].C;
+	if (edgeSum <= 0)
+	{
+		return false;
 	}
 
-	// We use 1 / V.z to calculate the current pixel depth
-	//	1 / P.z =  (1 / V0.z) * D0 + (1 / V1.z) * D1 + (1 / V2.z) * D2
-	rasterv0.z = 1.0f / rasterv0.z;
-	rasterv1.z = 1.0f / rasterv1.z;
-	rasterv2.z = 1.0f / rasterv2.z;
+	// Pixels whose centers can be inside the triangle
+	int64_t minX = glm::min(glm::min(fixedv0.x, fixedv1.x), fixedv2.x);
+	int64_t minY = glm::min(glm::min(fixedv0.y, fixedv1.y), fixedv2.y);
+	int64_t maxX = glm::max(glm::max(fixedv0.x, fixedv1.x), fixedv2.x);
+	int64_t maxY = glm::max(glm::max(fixedv0.y, fixedv1.y), fixedv2.y);
+	setup.Bounds.x = (int)((minX + kSubPixelHalf - 1) >> kSubPixelBits);
+	setup.Bounds.y = (int)((minY + kSubPixelHalf - 1) >> kSubPixelBits);
+	setup.Bounds.z = (int)((maxX - kSubPixelHalf) >> kSubPixelBits);
+	setup.Bounds.w = (int)((maxY - kSubPixelHalf) >> kSubPixelBits);
 
-	// Attribute correct interpolation:
-	//	1) att0 /= raster0.z
-	//  2) Find cur attribute using bary coords
-	//  3) Finally, mult by z
+	// Inside the bounds |E| <= 2 * extent^2, which is what a 32 bit lane can hold
+	setup.Fits32Bits = (maxX - minX) < kMax32BitExtent && (maxY - minY) < kMax32BitExtent;
 
-	// TexCoords
-	glm::vec2 rasterTexCoord0 = vtx[0].TexCoord * rasterv0.z;
-	glm::vec2 rasterTexCoord1 = vtx[1].TexCoord * rasterv1.z;
-	glm::vec2 rasterTexCoord2 = vtx[2].TexCoord * rasterv2.z;
-	// Normals
-	glm::vec3 rasterNormal0 = vtx[0].Normal * rasterv0.z;
-	glm::vec3 rasterNormal1 = vtx[1].Normal * rasterv1.z;
-	glm::vec3 rasterNormal2 = vtx[2].Normal * rasterv2.z;
+	// Post projection depth is linear in screen space, we interpolate it as it is
+	SetupPlane(setup, vtx[0].Position.z, vtx[1].Position.z, vtx[2].Position.z, setup.Depth);
+	setup.MinDepth = glm::min(glm::min(vtx[0].Position.z, vtx[1].Position.z), vtx[2].Position.z);
+	setup.MaxDepth = glm::max(glm::max(vtx[0].Position.z, vtx[1].Position.z), vtx[2].Position.z);
 
-	// Triangle bounding quad:
-	glm::vec4 bounds = GetBounds(rasterv0, rasterv1, rasterv2);
+	return true;
+}
 
-	for (int sy = bounds.y; sy <= bounds.w; ++sy)
+void NRaster::SetupAttributes(const Vertex* vtx, TriangleSetup& setup)
+{
+	// Attribute correct interpolation, position.w holds 1 / w of the vertex:
+	//	1) att0 /= raster0.w
+	//  2) Find cur attribute and 1 / w with their planes
+	//  3) Finally, mult by w
+	float invW[3];
+	glm::vec2 texCoords[3];
+	glm::vec3 normals[3];
+	for (int i = 0; i < 3; ++i)
+	{
+		invW[i] = vtx[i].Position.w;
+		texCoords[i] = vtx[i].TexCoord * invW[i];
+		normals[i] = vtx[i].Normal * invW[i];
+	}
+	SetupPlane(setup, invW[0], invW[1], invW[2], setup.InvW);
+	for (int c = 0; c < 2; ++c)
 	{
-		
-		uint32_t rowOffset = sy * width;
-		PixelRGBA32* curPixelRow = &pixels[rowOffset];
-		float* curDepthRow = &depthBuffer[rowOffset];
+		SetupPlane(setup, texCoords[0][c], texCoords[1][c], texCoords[2][c], setup.TexCoords[c]);
+	}
+	for (int c = 0; c < 3; ++c)
+	{
+		SetupPlane(setup, normals[0][c], normals[1][c], normals[2][c], setup.Normals[c]);
+	}
+}
+
+void NRaster::SetupPlane(const TriangleSetup& setup, float v0, float v1, float v2, PlaneEquation& plane)
+{
+	// The weight of each vertex is its edge function over their sum, which is the same everywhere.
+	// Doubles, the edge functions of big triangles don't fit in a float.
+	const TriangleEdge* edges = setup.Edges;
+	double weightRcp = 1.0 / (double)(edges[0].C + edges[1].C + edges[2].C);
+
+	// Center of the first pixel of the bounds, the origin of the planes
+	int64_t x = ((int64_t)setup.Bounds.x * kSubPixelSteps) + kSubPixelHalf;
+	int64_t y = ((int64_t)setup.Bounds.y * kSubPixelSteps) + kSubPixelHalf;
+	double e0 = (double)(edges[0].A * x + edges[0].B * y + edges[0].C);
+	double e1 = (double)(edges[1].A * x + edges[1].B * y + edges[1].C);
+	double e2 = (double)(edges[2].A * x + edges[2].B * y + edges[2].C);
 
-		for (int sx = bounds.x; sx <= bounds.z; ++sx)
+	// Edges step per sub pixel, the planes per pixel
+	plane.A = (float)(((double)v0 * edges[0].A + (double)v1 * edges[1].A + (double)v2 * edges[2].A) * weightRcp * kSubPixelSteps);
+	plane.B = (float)(((double)v0 * edges[0].B + (double)v1 * edges[1].B + (double)v2 * edges[2].B) * weightRcp * kSubPixelSteps);
+	plane.C = (float)(((double)v0 * e0 + (double)v1 * e1 + (double)v2 * e2) * weightRcp);
+}
+
+bool NRaster::IsSpanVisible(const glm::ivec4& bounds, const glm::ivec4& rect)
+{
+	// Inclusive bounds against the half open rect. Empty bounds (no pixel center inside) never pass
+	return bounds.x <= bounds.z && bounds.y <= bounds.w &&
+		bounds.x < rect.x + rect.z && bounds.z >= rect.x &&
+		bounds.y < rect.y + rect.w && bounds.w >= rect.y;
+}
+
+bool NRaster::IsHiZOccluded(const RenderState& renderState, DepthTest::T depthTest, float minDepth, const glm::ivec4& bounds)
+{
+	const HiZBuffer& hiZ = renderState.HiZ;
+	if (!hiZ.BlockMaxDepth)
+	{
+		return false;
+	}
+
+	// Farthest depth of the tiles overlapped by the inclusive pixel bounds
+	int tileSize = hiZ.BlocksPerTile * kRasterBlockSize;
+	int minTileX = glm::max(bounds.x, 0) / tileSize;
+	int minTileY = glm::max(bounds.y, 0) / tileSize;
+	int maxTileX = glm::min(bounds.z, (int)renderState.RtSize.z - 1) / tileSize;
+	int maxTileY = glm::min(bounds.w, (int)renderState.RtSize.w - 1) / tileSize;
+	float maxDepth = -FLT_MAX;
+	for (int ty = minTileY; ty <= maxTileY; ++ty)
+	{
+		for (int tx = minTileX; tx <= maxTileX; ++tx)
 		{
-			// Clip if its outside the bounds
-			if (!PointInsideRect(glm::vec2(sx, sy), renderState.ScreenRect))
-			{
-				continue;
-			}
-			glm::ivec3 rasterPixel(sx,sy,0); // +0.5->center pixel
+			maxDepth = glm::max(maxDepth, hiZ.TileMaxDepth[ty * hiZ.NumTilesWidth + tx]);
+		}
+	}
 
-			// Areas of the parallelograms [rastervx, rastervy, rasterPixel]
-			float w0 = EdgeTest(rasterv1, rasterv2, rasterPixel);
-			float w1 = EdgeTest(rasterv2, rasterv0, rasterPixel);
-			float w2 = EdgeTest(rasterv0, rasterv1, rasterPixel);
+	minDepth -= kHiZDepthBias;
+	switch (depthTest)
+	{
+	case DepthTest::Equal:
+		return HiZRejects<DepthTest::Equal>(minDepth, maxDepth);
+	default:
+		return HiZRejects<DepthTest::LessThan>(minDepth, maxDepth);
+	}
+}
 
-			if ((w0 > 0.0f) && (w1 > 0.0f) && (w2 > 0.0f))
+void NRaster::UpdateHiZTiles(const RenderState& renderState, const glm::ivec4& span)
+{
+	// Tiles overlapped by the inclusive span, as the max of their blocks
+	const HiZBuffer& hiZ = renderState.HiZ;
+	int tileSize = hiZ.BlocksPerTile * kRasterBlockSize;
+	int numBlocksHeight = ((int)renderState.RtSize.w + kRasterBlockSize - 1) / kRasterBlockSize;
+	for (int ty = span.y / tileSize; ty <= span.w / tileSize; ++ty)
+	{
+		for (int tx = span.x / tileSize; tx <= span.z / tileSize; ++tx)
+		{
+			int endBlockX = glm::min((tx + 1) * hiZ.BlocksPerTile, hiZ.NumBlocksWidth);
+			int endBlockY = glm::min((ty + 1) * hiZ.BlocksPerTile, numBlocksHeight);
+			float maxDepth = -FLT_MAX;
+			for (int by = ty * hiZ.BlocksPerTile; by < endBlockY; ++by)
 			{
-				// Barycentric coordinates. Ratio between the area of the triangle 
-				// and ratio of the area of each vx,vy,pixel. Note that we do not divide by 2, as it cancels out.
-				w0 *= areaRcp;
-				w1 *= areaRcp;
-				w2 *= areaRcp;
-
-				// Depth test [LESS_THAN]:
-				float pixelDepth = 1.0f / (rasterv0.z * w0 + rasterv1.z * w1 + rasterv2.z * w2);
-				if (pixelDepth < curDepthRow[sx])
+				for (int bx = tx * hiZ.BlocksPerTile; bx < endBlockX; ++bx)
 				{
-					// Update depth buffer:
-					curDepthRow[sx] = pixelDepth;
-
-					// Perspective correct attributes:
-					Vertex interpolatedData;
-					interpolatedData.Normal = (rasterNormal0 * w0 + rasterNormal1 * w1 + rasterNormal2 * w2) * pixelDepth;
-					interpolatedData.TexCoord = (rasterTexCoord0 * w0 + rasterTexCoord1 * w1 + rasterTexCoord2 * w2) * pixelDepth;
-
-					// Pixel shader:
-					glm::vec4 pixel = renderState.PixelShader(interpolatedData);
-
-					// Pixel color:
-					curPixelRow[sx].R = (uint8_t)(pixel.r * 255.0f);
-					curPixelRow[sx].G = (uint8_t)(pixel.g * 255.0f);
-					curPixelRow[sx].B = (uint8_t)(pixel.b * 255.0f);
-					curPixelRow[sx].A = (uint8_t)(pixel.a * 255.0f);
+					maxDepth = glm::max(maxDepth, hiZ.BlockMaxDepth[by * hiZ.NumBlocksWidth + bx]);
 				}
 			}
+			hiZ.TileMaxDepth[ty * hiZ.NumTilesWidth + tx] = maxDepth;
 		}
 	}
 }
 
-bool NRaster::PointInsideRect(const glm::vec2& p, const glm::vec4& rect)
+void NRaster::RasterFrameDraws()
 {
-	if (p.x >= rect.x &&
-		p.x <= (rect.x + rect.z) &&
-		p.y >= rect.y &&
-		p.y <= (rect.y + rect.w))
-	{
-		return true;
-	}
-	return false;
+	// The draws recorded so far, the frame keeps going after them
+	FrameData& frame = m_frames[m_curFrame];
+	SubmitTiles(frame);
+	CompleteFrame(frame);
 }
 
-bool NRaster::RectInsideRect(const glm::vec4& a, const glm::vec4& b)
+void NRaster::SubmitTiles(FrameData& frame)
 {
-	glm::vec4 ra = glm::vec4(a.x, a.y, a.z - a.x, a.w - a.y);
-	glm::vec4 rb = glm::vec4(b.x, b.y, b.z - b.x, b.w - b.y);
-	//	x  y    z       w
-	// [x, y, width, height]
-	if (ra.x + ra.z >= rb.x &&
-		ra.x <= rb.x + rb.z &&
-		ra.y + ra.w >= rb.y && 
-		ra.y <= rb.y + rb.w)
+	frame.InFlight = true;
+	frame.RasterContexts.clear();
+	if (frame.Draws.empty())
+	{
+		return;
+	}
+
+	// Schedule jobs, one per tile with any triangle of any draw.
+	// Contexts are reserved for every bin so pushing them never reallocates
+	// and the pointers handed to the workers stay valid.
+	int width = m_renderState.ScreenRect.z;
+	int height = m_renderState.ScreenRect.w;
+	frame.RasterContexts.reserve(m_numBinsWidth * m_numBinsHeight);
+	for (int by = 0; by < m_numBinsHeight; ++by)
 	{
-		return true;
+		for (int bx = 0; bx < m_numBinsWidth; ++bx)
+		{
+			int binIndex = by * m_numBinsWidth + bx;
+			bool empty = true;
+			for (uint32_t c = 0; c < frame.NumGeometryContexts && empty; ++c)
+			{
+				empty = frame.GeometryContexts[c].Bins[binIndex].empty();
+			}
+			if (empty)
+			{
+				continue;
+			}
+			// if ((by == 2) && (bx == 3))
+			{
+				int zoneX = bx * m_binWidth;
+				int zoneY = by * m_binHeight;
+				glm::vec4 threadZone(zoneX, zoneY, glm::min(m_binWidth, width - zoneX), glm::min(m_binHeight, height - zoneY));
+				frame.RasterContexts.emplace_back(frame.Draws.data(), (uint32_t)frame.Draws.size(), frame.GeometryContexts.data(), binIndex, threadZone, glm::vec4(0, 0, 1, 1));
+				m_threadPool->Submit(NRaster::RasterTraingleMT, (void*)&frame.RasterContexts.back(), &frame.RasterJobs);
+			}
+		}
 	}
-	return false;
 }
 
-glm::vec4 NRaster::GetBounds(const glm::vec3& a, const glm::vec3& b, const glm::vec3& c)
+void NRaster::CompleteFrame(FrameData& frame)
 {
-	glm::vec4 bounds;
-	bounds.x = (int)glm::min(glm::min(a.x, b.x), c.x);
-	bounds.y = (int)glm::min(glm::min(a.y, b.y), c.y);
-	bounds.z = (int)glm::max(glm::max(a.x, b.x), c.x);
-	bounds.w = (int)glm::max(glm::max(a.y, b.y), c.y);
-	return bounds;
+	if (!frame.InFlight)
+	{
+		return;
+	}
+
+	// Wait for its tiles to be done, bins are cleared when their contexts are used again
+	m_threadPool->Wait(frame.RasterJobs);
+	frame.InFlight = false;
+	auto doneTime = frame.EndTime;
+	for (uint32_t i = 0; i < frame.RasterContexts.size(); ++i)
+	{
+		m_stats.Add(frame.RasterContexts[i].Stats);
+		doneTime = std::max(doneTime, frame.RasterContexts[i].EndTime);
+	}
+
+	for (uint32_t i = 0; i < frame.Draws.size(); ++i)
+	{
+		FrameDraw& draw = frame.Draws[i];
+		if (draw.OwnsPixelShader)
+		{
+			draw.Pipeline.DeletePixelShader((void*)draw.Pipeline.PixelShader);
+		}
+	}
+	frame.Draws.clear();
+	frame.NumGeometryContexts = 0;
+
+	if (frame.Ended)
+	{
+		// Overlap with the recording of the next frame, up to now if it didn't end yet
+		auto now = std::chrono::high_resolution_clock::now();
+		float overlapMS = 0.0f;
+		const FrameData& next = m_frames[(&frame - m_frames.data() + 1) % m_frames.size()];
+		if (next.Index == frame.Index + 1)
+		{
+			auto overlapStart = std::max(frame.EndTime, next.BeginTime);
+			auto overlapEnd = std::min(doneTime, next.Ended ? next.EndTime : now);
+			overlapMS = glm::max(std::chrono::duration<float, std::milli>(overlapEnd - overlapStart).count(), 0.0f);
+		}
+		m_lastFrameTimings.RecordMS = std::chrono::duration<float, std::milli>(frame.EndTime - frame.BeginTime).count();
+		m_lastFrameTimings.RasterMS = std::chrono::duration<float, std::milli>(doneTime - frame.EndTime).count();
+		m_lastFrameTimings.OverlapMS = overlapMS;
+		m_lastFrameTimings.LatencyMS = std::chrono::duration<float, std::milli>(now - frame.BeginTime).count();
+		frame.Ended = false;
+	}
 }
 
 void NRaster::RasterTraingleMT(void* renderContext)
@@ -350,16 +1281,134 @@ void NRaster::RasterTraingleMT(void* renderContext)
 	{
 		return;
 	}
-	context->MTState.RtSize = context->MTState.ScreenRect;
-	context->MTState.ScreenRect = context->Rect;
 
 	// Sort triangles... sadly makes it slower :(
-	//std::sort(context->MTTriangles.begin(), context->MTTriangles.end(), [](BinnedTriangle& a, BinnedTriangle& b) {
+	//std::sort(triangles.begin(), triangles.end(), [](TriangleSetup& a, TriangleSetup& b) {
 	//	return a.MinDepth > b.MinDepth;
 	//});
 
-	for (uint32_t i = 0; i != context->MTTriangles.size(); ++i)
+	// Draws and their chunks in order, so the triangles are drawn in the order they were submitted
+	glm::ivec4 tileBounds(context->Rect.x, context->Rect.y, context->Rect.x + context->Rect.z - 1, context->Rect.y + context->Rect.w - 1);
+	for (uint32_t d = 0; d < context->NumDraws; ++d)
+	{
+		const FrameDraw& draw = context->Draws[d];
+		RenderState tileState = draw.State;
+		tileState.RtSize = tileState.ScreenRect;
+		tileState.ScreenRect = context->Rect;
+
+		for (uint32_t c = 0; c < draw.NumGeometryContexts; ++c)
+		{
+			const GeometryContext& geometry = context->GeometryContexts[draw.FirstGeometryContext + c];
+			const std::vector<uint32_t>& bin = geometry.Bins[context->BinIndex];
+			for (uint32_t i = 0; i != bin.size(); ++i)
+			{
+				const TriangleSetup& setup = geometry.Triangles[bin[i]];
+
+				// Behind everything already drawn in the tile
+				if (IsHiZOccluded(tileState, draw.Pipeline.DTest, setup.MinDepth, tileBounds))
+				{
+					++context->Stats.TrianglesHiZCulled;
+					continue;
+				}
+				draw.Pipeline.Raster(tileState, setup, geometry.FirstTriangleId + bin[i], context->Stats);
+			}
+		}
+	}
+	context->EndTime = std::chrono::high_resolution_clock::now();
+}
+
+NRaster::VisibilityDraw& NRaster::AddVisibilityDraw()
+{
+	if (m_numVisibilityDraws == m_visibilityDraws.size())
+	{
+		m_visibilityDraws.emplace_back();
+	}
+	m_renderState.DrawId = m_numVisibilityDraws++;
+	VisibilityDraw& draw = m_visibilityDraws[m_renderState.DrawId];
+	draw.Triangles.clear();
+	return draw;
+}
+
+void NRaster::ResolveVisibility()
+{
+	if (!m_renderState.VisibilityBuffer)
+	{
+		std::cout << "[NRaster][ResolveVisibility][Warning]: There is no visibility buffer set. \n";
+		return;
+	}
+	RasterFrameDraws();
+	Finish();
+
+#if defined(MULTICORE)
+	// Every tile shades its own pixels, all the contexts are added before any job runs
+	int width = m_renderState.ScreenRect.z;
+	int height = m_renderState.ScreenRect.w;
+	m_resolveContexts.resize(m_numBinsWidth * m_numBinsHeight);
+	for (int by = 0; by < m_numBinsHeight; ++by)
+	{
+		for (int bx = 0; bx < m_numBinsWidth; ++bx)
+		{
+			ResolveContextMT& context = m_resolveContexts[by * m_numBinsWidth + bx];
+			int zoneX = bx * m_binWidth;
+			int zoneY = by * m_binHeight;
+			context.Raster = this;
+			context.Rect = glm::ivec4(zoneX, zoneY, glm::min(m_binWidth, width - zoneX), glm::min(m_binHeight, height - zoneY));
+			context.Stats = RasterStats();
+		}
+	}
+	for (uint32_t i = 0; i < m_resolveContexts.size(); ++i)
+	{
+		m_threadPool->Submit(NRaster::ResolveVisibilityMT, (void*)&m_resolveContexts[i]);
+	}
+	m_threadPool->WaitIdle();
+	for (uint32_t i = 0; i < m_resolveContexts.size(); ++i)
+	{
+		m_stats.Add(m_resolveContexts[i].Stats);
+	}
+#else
+	ResolveTile(m_renderState.ScreenRect, m_stats);
+#endif
+
+	// The draws are done, the next frame starts from the first one
+	for (uint32_t i = 0; i < m_numVisibilityDraws; ++i)
 	{
-		NRaster::RasterTriangle(context->MTState, (Vertex*)context->MTTriangles[i].Verts);
+		m_visibilityDraws[i].DeletePixelShader(m_visibilityDraws[i].PixelShader);
+		m_visibilityDraws[i].PixelShader = nullptr;
+	}
+	m_numVisibilityDraws = 0;
+}
+
+void NRaster::ResolveVisibilityMT(void* resolveContext)
+{
+	ResolveContextMT* context = (ResolveContextMT*)resolveContext;
+	context->Raster->ResolveTile(context->Rect, context->Stats);
+}
+
+void NRaster::ResolveTile(const glm::ivec4& rect, RasterStats& stats) const
+{
+	int width = m_renderState.ScreenRect.z;
+	int endX = rect.x + rect.z;
+	for (int y = rect.y; y < rect.y + rect.w; ++y)
+	{
+		// Runs of pixels from the same draw are shaded with a single call
+		const VisibilityId* ids = &m_renderState.VisibilityBuffer[y * width];
+		int x = rect.x;
+		while (x < endX)
+		{
+			uint32_t drawId = ids[x].DrawId;
+			int runEnd = x + 1;
+			while (runEnd < endX && ids[runEnd].DrawId == drawId)
+			{
+				++runEnd;
+			}
+			if (drawId != kInvalidDrawId)
+			{
+				assert(drawId < m_numVisibilityDraws);
+				const VisibilityDraw& draw = m_visibilityDraws[drawId];
+				draw.ResolveSpan(m_renderState, draw, x, runEnd - 1, y);
+				stats.PixelShaderInvocations += runEnd - x;
+			}
+			x = runEnd;
+		}
 	}
 }
@@ -6,11 +6,15 @@
 */
 
 #include "glm.hpp"
+#include "gtc/type_precision.hpp"
 #include "NModel.h"
+#include "NThreadPool.h"
 #include <vector>
 #include <queue>
+#include <chrono>
 
 struct SDL_Renderer; 
+class NOcclusionBuffer;
 
 namespace tthread
 {
@@ -30,6 +34,7 @@ struct DepthTest
 	enum T
 	{
 		LessThan,
+		Equal,	// Shading pass after a depth only one
 		Count
 	};
 };
@@ -39,6 +44,19 @@ struct WindingOrder
 	enum T
 	{
 		CCW,
+		CW,
+		Count
+	};
+};
+
+// Pixel loops of the rasterizer, wider ones evaluate a row of pixels at once
+struct RasterKernel
+{
+	enum T
+	{
+		Scalar,
+		SSE41,	// 4x1 pixels
+		AVX2,	// 8x1 pixels
 		Count
 	};
 };
@@ -60,26 +78,234 @@ struct VertexRenderData
 };
 
 typedef glm::vec4(*VertexShaderFn)(const Vertex& vertex, const VertexRenderData& renderData);
+
+// Batched vertex shaders work on up to kVertexBatchSize vertices at once, laid out as
+// structure of arrays so the shader can be vectorized.
+static const uint32_t kVertexBatchSize = 48;
+
+struct VertexStreams
+{
+	const float* PositionX;
+	const float* PositionY;
+	const float* PositionZ;
+	const float* PositionW;
+	const float* NormalX;
+	const float* NormalY;
+	const float* NormalZ;
+	const float* ColorR;
+	const float* ColorG;
+	const float* ColorB;
+	const float* TexCoordU;
+	const float* TexCoordV;
+	uint32_t Count;
+};
+
+struct ClipPositionStreams
+{
+	float* X;
+	float* Y;
+	float* Z;
+	float* W;
+};
+
+// Computed once per draw
+struct VertexShaderUniforms
+{
+	glm::mat4 ModelViewProjection;
+	VertexRenderData RenderData;
+	VertexShaderFn VertexShader;	// Only used to run per vertex shaders as batched ones
+};
+
+// Written per pixel by visibility buffer draws, the closest triangle of each pixel
+struct VisibilityId
+{
+	uint32_t DrawId;	// kInvalidDrawId if nothing was drawn
+	uint32_t TriangleId;
+};
+static const uint32_t kInvalidDrawId = 0xffffffff;
+
+typedef void(*VertexBatchShaderFn)(const VertexStreams& in, const VertexShaderUniforms& uniforms, ClipPositionStreams& out);
 typedef glm::vec4(*PixelShaderFn)(const Vertex& vertex);
 
+// Conservative max depth of the depth buffer per block and per tile, hidden triangles and blocks
+// are rejected against it before any per pixel work. Tiles are a whole number of blocks.
+struct HiZBuffer
+{
+	float* BlockMaxDepth;	// Null when it is not in sync with the depth buffer
+	float* TileMaxDepth;
+	int NumBlocksWidth;
+	int NumTilesWidth;
+	int BlocksPerTile;
+};
+
 struct RenderState
 {
 	PixelRGBA32* RenderTarget;
 	float* DepthBuffer;
 	DepthTest::T DTest;
+	bool DepthWrite;
+	HiZBuffer HiZ;
 	WindingOrder::T WOrder;
 	glm::vec4 RtSize;
-	glm::ivec4 ScreenRect;	// x,y,w,h
+	glm::ivec4 ScreenRect;	// x,y,w,h. Half open, covers [x, x + w) x [y, y + h)
 	VertexShaderFn VertexShader;
+	VertexBatchShaderFn VertexBatchShader;	// Set instead of VertexShader when using a batched one
 	PixelShaderFn PixelShader;
+	const void* PixelShaderObject;	// Functor of the current draw
+	VisibilityId* VisibilityBuffer;	// Null when shading while rasterizing
+	uint32_t DrawId;	// Visibility buffer draws
+	RasterKernel::T Kernel;
 };
 
-struct BinnedTriangle
+// Raster positions are snapped to a 1/16 pixel grid, edge functions are then exact integers.
+static const int kSubPixelBits = 4;
+static const int kSubPixelSteps = 1 << kSubPixelBits;
+static const int kSubPixelHalf = kSubPixelSteps / 2;
+// Max distance from the origin (in pixels) of a vertex we can snap without overflowing.
+static const float kMaxRasterCoord = 32768.0f;
+// Triangles reaching this far (in pixels) outside the viewport are rasterized without clipping,
+// the 2D traversal skips the hidden part. Only the ones going further get clipped in x/y.
+static const float kGuardBandPixels = 4096.0f;
+// A triangle clipped against the near plane and the four guard band planes.
+static const int kMaxClipVertices = 3 + 5;
+
+struct ClipPlane
 {
-	Vertex Verts[3];
+	enum T
+	{
+		Left		= 1 << 0,
+		Right		= 1 << 1,
+		Bottom		= 1 << 2,
+		Top			= 1 << 3,
+		Near		= 1 << 4,
+		Far			= 1 << 5,
+		GuardLeft	= 1 << 6,
+		GuardRight	= 1 << 7,
+		GuardBottom	= 1 << 8,
+		GuardTop	= 1 << 9,
+
+		FrustumMask = Left | Right | Bottom | Top | Near | Far,
+		ClipMask = Near | GuardLeft | GuardRight | GuardBottom | GuardTop
+	};
+};
+// Triangles smaller than this (in sub pixels) can be stepped with 32 bit edge functions.
+static const int64_t kMax32BitExtent = 1 << 15;
+// Triangles are walked in blocks of NxN pixels, classified against the edges as a whole.
+static const int kRasterBlockSize = 8;
+// Interpolated depths can land slightly in front of the vertex ones, Hi-Z tests keep this margin.
+static const float kHiZDepthBias = 1e-5f;
+
+struct TriangleEdge
+{
+	int64_t C;	// Value at the origin, fill rule bias included
+	int32_t A;	// Change when moving one sub pixel step in x
+	int32_t B;	// Change when moving one sub pixel step in y
+};
+
+// Value interpolated over a triangle, V = A * x + B * y + C. x and y are in pixels, relative to
+// the first pixel of the triangle bounds so the planes keep their precision anywhere on screen.
+struct PlaneEquation
+{
+	float A;
+	float B;
+	float C;
+};
+
+// Done once per triangle and shared by all the tiles it overlaps
+struct TriangleSetup
+{
+	TriangleEdge Edges[3];
+	glm::ivec4 Bounds;	// Inclusive pixel bounds: min x, min y, max x, max y
+	PlaneEquation Depth;
 	float MinDepth;
+	float MaxDepth;
+	PlaneEquation InvW;	// Attributes, only set up when the pixel shader reads them
+	PlaneEquation TexCoords[2];	// Divided by w
+	PlaneEquation Normals[3];	// Divided by w
+	bool Fits32Bits;
+};
+
+// Counters accumulated by the rasterizer until ResetStats() is called
+struct RasterStats
+{
+	RasterStats() :
+		  DrawsFrustumCulled(0)
+		, DrawsOcclusionCulled(0)
+		, VertexShaderInvocations(0)
+		, PixelShaderInvocations(0)
+		, TrianglesClipRejected(0)
+		, TrianglesClipped(0)
+		, TrianglesClipPassed(0)
+		, TrianglesCulled(0)
+		, TrianglesBinned(0)
+		, BlocksRejected(0)
+		, BlocksAccepted(0)
+		, BlocksPartial(0)
+		, TrianglesHiZCulled(0)
+		, BlocksHiZCulled(0)
+	{
+	}
+	void Add(const RasterStats& other)
+	{
+		DrawsFrustumCulled += other.DrawsFrustumCulled;
+		DrawsOcclusionCulled += other.DrawsOcclusionCulled;
+		VertexShaderInvocations += other.VertexShaderInvocations;
+		PixelShaderInvocations += other.PixelShaderInvocations;
+		TrianglesClipRejected += other.TrianglesClipRejected;
+		TrianglesClipped += other.TrianglesClipped;
+		TrianglesClipPassed += other.TrianglesClipPassed;
+		TrianglesCulled += other.TrianglesCulled;
+		TrianglesBinned += other.TrianglesBinned;
+		BlocksRejected += other.BlocksRejected;
+		BlocksAccepted += other.BlocksAccepted;
+		BlocksPartial += other.BlocksPartial;
+		TrianglesHiZCulled += other.TrianglesHiZCulled;
+		BlocksHiZCulled += other.BlocksHiZCulled;
+	}
+
+	uint64_t DrawsFrustumCulled;	// Bounds outside of the frustum, skipped before vertex shading
+	uint64_t DrawsOcclusionCulled;	// Bounds hidden behind the occluders, skipped before vertex shading
+
+	uint64_t VertexShaderInvocations;
+	uint64_t PixelShaderInvocations;
+
+	uint64_t TrianglesClipRejected;	// Fully outside the frustum
+	uint64_t TrianglesClipped;		// Crossing the near plane or the guard band
+	uint64_t TrianglesClipPassed;	// Sent to raster as they were
+	uint64_t TrianglesCulled;		// Back facing, degenerated or not covering any pixel center on screen
+	uint64_t TrianglesBinned;		// Ids added to the bins, MULTICORE only
+
+	uint64_t BlocksRejected;	// Fully outside the triangle, skipped
+	uint64_t BlocksAccepted;	// Fully inside, filled without edge tests
+	uint64_t BlocksPartial;		// Edges tested per pixel
+
+	uint64_t TrianglesHiZCulled;	// Behind every tile they overlap, counted per tile in MULTICORE
+	uint64_t BlocksHiZCulled;		// Behind the depth already in the block
 };
 
+// Timings of the last frame whose tiles are done, to see what pipelining frames gets us
+struct FrameTimings
+{
+	FrameTimings() :
+		  RecordMS(0.0f)
+		, RasterMS(0.0f)
+		, OverlapMS(0.0f)
+		, LatencyMS(0.0f)
+	{
+	}
+
+	float RecordMS;		// BeginFrame to EndFrame, geometry and binning of the draws
+	float RasterMS;		// EndFrame to the last tile being done
+	float OverlapMS;	// Part of RasterMS that ran while the next frame was recorded
+	float LatencyMS;	// BeginFrame to the frame being handed back, anything above RecordMS + RasterMS is added by pipelining
+};
+
+static const int kDefaultTileSize = 64;
+// Upper limit of SetMaxFramesInFlight.
+static const uint32_t kMaxFramesInFlight = 4;
+// Draws are split in chunks of at least this many triangles for the geometry stage.
+static const uint32_t kMinTrianglesPerGeometryJob = 512;
+
 class NRaster
 {
 private:
@@ -91,37 +317,237 @@ public:
 	static NRaster* Instance();
 	bool Initialize();
 
+	// Workers used to raster the tiles, recreates the pool.
+	void SetNumWorkers(uint32_t numWorkers);
+	uint32_t GetNumWorkers()const;
+	// Time each worker spent running jobs since the last reset.
+	float GetWorkerBusyTimeMS(uint32_t worker)const;
+	void ResetWorkerStats();
+
+	// Pixel kernel used by the rasterizer, the widest supported one by default.
+	void SetRasterKernel(RasterKernel::T kernel);
+	RasterKernel::T GetRasterKernel()const;
+
+	// Rasterizer counters since the last reset.
+	const RasterStats& GetStats()const;
+	void ResetStats();
+
+	// Size in pixels of the square tiles the screen is split into, rounded up to whole raster blocks.
+	void SetTileSize(int tileSize);
+	int GetTileSize()const;
+
 	void SetViewport(int x, int y, int w, int h);
 	void SetRenderTarget(PixelRGBA32* data);
 	void SetDepthBuffer(float* data);
+	// Clears the depth buffer of the viewport and the Hi-Z built on top of it. Hi-Z culling is on from
+	// here until the depth buffer or the viewport are set again, so the depth buffer must not be
+	// written by other means in between.
+	void ClearDepthBuffer(float depth);
+	void SetDepthTest(DepthTest::T depthTest);
+	void SetDepthWrite(bool depthWrite);
+	// A null pixel shader only writes depth, for depth prepasses.
 	void SetShaders(VertexShaderFn vertexShader, PixelShaderFn pixelShader);
+	void SetShaders(VertexBatchShaderFn vertexShader, PixelShaderFn pixelShader);
 	void Draw(Vertex* data, uint32_t numVertices);
+	// Triangle list through an index buffer, every vertex is shaded once.
+	void DrawIndexed(const Vertex* vertices, uint32_t numVertices, const uint32_t* indices, uint32_t numIndices);
+	// Same as Draw/DrawIndexed with the shaders and the state fixed at compile time, so they get
+	// inlined in the kernels. Null indices for non indexed draws. The shaders are functors:
+	//	VS: glm::vec4 operator()(const Vertex& vertex, const VertexShaderUniforms& uniforms) const
+	//	PS: glm::vec4 operator()(const Vertex& vertex) const, or NoPixelShader to only write depth
+	template<typename VS, typename PS, DepthTest::T kDepthTest, WindingOrder::T kWinding, bool kDepthWrite = true>
+	void Draw(const Vertex* vertices, uint32_t numVertices, const uint32_t* indices, uint32_t numIndices, const VS& vertexShader = VS(), const PS& pixelShader = PS());
 	void SetTransforms(glm::mat4 transform, glm::mat4 view, glm::mat4 projection);
 
+	// Draws in between are binned when submitted, but only rasterized at EndFrame in a single pass
+	// where each tile draws all of them in submission order. Setting the viewport, the tile size or
+	// the depth buffer, clearing depth and resolving the visibility buffer first raster the draws
+	// recorded so far. Single core rasterizes the draws when they are submitted.
+	void BeginFrame();
+	void EndFrame();
+	// Frames can be recorded while the tiles of the previous ones are still running. EndFrame returns
+	// once the oldest frame is done, so after it the frames ended before the last numFrames - 1 are
+	// complete. Every frame in flight needs its own render target and depth buffer, and Hi-Z needs a
+	// ClearDepthBuffer every frame. One by default, EndFrame waits for the frame it ends.
+	void SetMaxFramesInFlight(uint32_t numFrames);
+	uint32_t GetMaxFramesInFlight()const;
+	// Waits for the tiles of all the frames in flight.
+	void Finish();
+	const FrameTimings& GetLastFrameTimings()const;
+
+	// Occlusion culling of whole draws. Occluders are drawn depth only with the current transforms
+	// into a small buffer, draws with bounds are skipped before vertex shading if hidden behind them.
+	void SetOcclusionBufferSize(int width, int height);
+	void ClearOccluders();
+	void DrawOccluder(const Vertex* vertices, uint32_t numVertices, const uint32_t* indices, uint32_t numIndices);
+	bool IsVisible(const AABB& bounds, const glm::mat4& mvp)const;
+	// Object space bounds of the next draws, null if they are unknown and must always be drawn. Draws
+	// outside of the frustum or occluded are skipped. The sphere is a faster first test, it is
+	// derived from the box if null.
+	void SetDrawBounds(const AABB* bounds, const BoundingSphere* sphere = nullptr);
+
+	// Visibility buffer mode, null to shade while rasterizing. Draws only write depth and the ids of
+	// the closest triangle, ResolveVisibility() then shades every covered pixel once. The buffer has
+	// to be cleared to kInvalidDrawId every frame, like the depth buffer.
+	void SetVisibilityBuffer(VisibilityId* data);
+	void ResolveVisibility();
+
 	void DebugDraw(SDL_Renderer* renderer);
 
 private:
 
-	static float EdgeTest(const glm::vec3& a, const glm::vec3& b, const glm::vec3& c);
-	static void RasterTriangle(const RenderState& renderState, Vertex* vtx);
-	static bool PointInsideRect(const glm::vec2& p, const glm::vec4& rect);
-	static bool RectInsideRect(const glm::vec4& a, const glm::vec4& b);
-	static glm::vec4 GetBounds(const glm::vec3& a, const glm::vec3& b, const glm::vec3& c);
+	static void SetupEdge(const glm::i64vec2& a, const glm::i64vec2& b, TriangleEdge& edge);
+	static bool SetupTriangle(const Vertex* vtx, TriangleSetup& setup);
+	static void SetupAttributes(const Vertex* vtx, TriangleSetup& setup);
+	static void SetupPlane(const TriangleSetup& setup, float v0, float v1, float v2, PlaneEquation& plane);
+	template<typename PS, DepthTest::T kDepthTest, bool kDepthWrite>
+	static uint32_t RasterBlocks(const RenderState& renderState, const PS& pixelShader, const TriangleSetup& setup, RasterStats& stats);
+	template<typename PS, DepthTest::T kDepthTest, bool kDepthWrite>
+	static void RasterTriangle(const RenderState& renderState, const TriangleSetup& setup, uint32_t triangleId, RasterStats& stats);
+	template<DepthTest::T kDepthTest, bool kDepthWrite>
+	static void RasterTriangleVisibility(const RenderState& renderState, const TriangleSetup& setup, uint32_t triangleId, RasterStats& stats);
+	static bool IsSpanVisible(const glm::ivec4& bounds, const glm::ivec4& rect);
+	static bool IsHiZOccluded(const RenderState& renderState, DepthTest::T depthTest, float minDepth, const glm::ivec4& bounds);
+	static void UpdateHiZTiles(const RenderState& renderState, const glm::ivec4& span);
+
+	void ResizeBins();
+
+	// Draws shaded by ResolveVisibility, kept until then
+	struct VisibilityDraw;
+	typedef void(*ResolveSpanFn)(const RenderState& renderState, const VisibilityDraw& draw, int x, int endX, int y);
+	struct VisibilityDraw
+	{
+		std::vector<TriangleSetup> Triangles;	// Indexed by the triangle ids
+		void* PixelShader;	// Copy of the functor
+		void(*DeletePixelShader)(void* pixelShader);
+		ResolveSpanFn ResolveSpan;
+	};
+	VisibilityDraw& AddVisibilityDraw();
+	template<typename PS>
+	static void ResolveVisibilitySpan(const RenderState& renderState, const VisibilityDraw& draw, int x, int endX, int y);
+	template<typename PS>
+	static void* ClonePixelShader(const void* pixelShader);
+	template<typename PS>
+	static void DeletePixelShader(void* pixelShader);
+
+	struct ResolveContextMT
+	{
+		NRaster* Raster;
+		glm::ivec4 Rect;
+		RasterStats Stats;
+	};
+	static void ResolveVisibilityMT(void* resolveContext);
+	void ResolveTile(const glm::ivec4& rect, RasterStats& stats)const;
+
+	// Stages of one Draw<VS, PS, DepthTest, Winding> instantiation
+	typedef void(*RasterTriangleFn)(const RenderState& renderState, const TriangleSetup& setup, uint32_t triangleId, RasterStats& stats);
+	struct DrawPipeline
+	{
+		void(*ShadeVerticesJob)(void* geometryContext);
+		void(*ProcessGeometryJob)(void* geometryContext);
+		RasterTriangleFn Raster;
+		DepthTest::T DTest;	// The one Raster was instantiated with
+		bool NeedsAttributes;	// Set up the attribute planes of the triangles
+		const void* VertexShader;	// Functors of the draw
+		const void* PixelShader;
+		void*(*ClonePixelShader)(const void* pixelShader);	// For draws rasterized after they return
+		void(*DeletePixelShader)(void* pixelShader);
+		VisibilityDraw* Visibility;	// Visibility buffer draws
+	};
+
+	// A draw waiting for the tiles, its triangles are already binned
+	struct FrameDraw
+	{
+		DrawPipeline Pipeline;
+		RenderState State;	// As it was when the draw was submitted
+		uint32_t FirstGeometryContext;	// Its chunks, in order
+		uint32_t NumGeometryContexts;
+		bool OwnsPixelShader;	// Copied when recorded inside a frame
+	};
+
+	// Vertex shading, clipping and binning of a range of the triangles of a draw
+	struct GeometryContext
+	{
+		NRaster* Raster;
+		const DrawPipeline* Pipeline;
+		const Vertex* Vertices;
+		uint32_t NumVertices;
+		const uint32_t* Indices;	// Null for non indexed draws
+		uint32_t FirstCorner;	// Range of the index buffer, or of the vertices if there is none
+		uint32_t LastCorner;
+		const VertexShaderUniforms* Uniforms;
+		glm::vec4* ClipPositions;	// Indexed draws, the vertices shaded by all the chunks
+		uint32_t FirstVertex;	// Range of the vertices this chunk shades for indexed draws
+		uint32_t LastVertex;
+		glm::vec2 GuardBand;
+		std::vector<std::vector<uint32_t>> Bins;	// MULTICORE only, ids of the triangles overlapping each bin
+		std::vector<TriangleSetup> Triangles;	// The ones sent to raster, single core only keeps them for visibility buffer draws
+		uint32_t FirstTriangleId;
+		RasterStats Stats;
+	};
+	void DrawShaderFunctions(const Vertex* vertices, uint32_t numVertices, const uint32_t* indices, uint32_t numIndices);
+	void DrawTriangles(const Vertex* vertices, uint32_t numVertices, const uint32_t* indices, uint32_t numCorners, const DrawPipeline& pipeline);
+	template<typename VS>
+	static void ShadeVerticesMT(void* geometryContext);
+	template<typename VS, WindingOrder::T kWinding>
+	static void ProcessGeometryMT(void* geometryContext);
+	template<typename VS, WindingOrder::T kWinding>
+	void ProcessGeometry(GeometryContext& context)const;
+	template<typename VS>
+	void ShadeVertices(GeometryContext& context, const Vertex* vertices, uint32_t numVertices, glm::vec4* outPositions)const;
+	void ProcessTriangle(Vertex* clipVerts, GeometryContext& context)const;
+	void SubmitTriangle(const Vertex* clipVerts, GeometryContext& context)const;
+	static uint32_t ComputeOutcode(const glm::vec4& p, const glm::vec2& guardBand);
+	static uint32_t ClipTriangle(const Vertex* clipVerts, uint32_t clipPlanes, const glm::vec2& guardBand, Vertex* outPolygon);
 
 	struct RasterContextMT
 	{
-		RasterContextMT(const RenderState& _state,std::vector<BinnedTriangle>& _tris, glm::ivec4 _rect, glm::vec3 _debugCol) :
-			  MTState(_state)
-			, MTTriangles(_tris)
+		RasterContextMT(const FrameDraw* _draws, uint32_t _numDraws, const GeometryContext* _geometry, int _binIndex, glm::ivec4 _rect, glm::vec3 _debugCol) :
+			  Draws(_draws)
+			, NumDraws(_numDraws)
+			, GeometryContexts(_geometry)
+			, BinIndex(_binIndex)
 			, Rect(_rect)
 			, DebugColour(_debugCol)
 		{};
 
-		std::vector<BinnedTriangle>& MTTriangles;
-		RenderState MTState;
+		const FrameDraw* Draws;	// In submission order
+		uint32_t NumDraws;
+		const GeometryContext* GeometryContexts;	// The bins of the chunks of each draw are merged in order
+		int BinIndex;
 		glm::ivec4 Rect;
 		glm::vec3 DebugColour;
+		RasterStats Stats;
+		std::chrono::high_resolution_clock::time_point EndTime;
+	};
+
+	// What a frame owns until its tiles are done, one per frame in flight
+	struct FrameData
+	{
+		FrameData() :
+			  NumGeometryContexts(0)
+			, Index(0)
+			, Ended(false)
+			, InFlight(false)
+		{
+		}
+
+		std::vector<GeometryContext> GeometryContexts; // Reused, one per chunk of triangles of its draws
+		uint32_t NumGeometryContexts;
+		std::vector<FrameDraw> Draws; // Waiting for the tiles
+		std::vector<RasterContextMT> RasterContexts; // One per non empty bin
+		NThreadPool::JobGroup RasterJobs;
+		std::vector<float> HiZBlocks; // Max depth per raster block of the viewport
+		std::vector<float> HiZTiles; // Max depth per bin
+		uint64_t Index;
+		bool Ended;	// By EndFrame, not only drawn because of a state change
+		bool InFlight;	// Tiles submitted and not waited yet
+		std::chrono::high_resolution_clock::time_point BeginTime;
+		std::chrono::high_resolution_clock::time_point EndTime;
 	};
+	void RasterFrameDraws();
+	void SubmitTiles(FrameData& frame);
+	void CompleteFrame(FrameData& frame);
 	static void RasterTraingleMT(void* renderContext);
 
 	int m_numBinsWidth;
@@ -130,13 +556,33 @@ private:
 	int m_binWidth;
 	int m_binHeight;
 
-	std::vector<BinnedTriangle>* m_bins;
+	std::vector<FrameData> m_frames; // One per frame in flight, used in turns
+	uint32_t m_curFrame; // The one draws are recorded to
+	uint64_t m_frameIndex;
+	bool m_frameActive;
+	FrameTimings m_lastFrameTimings;
+	NThreadPool::JobGroup m_geometryJobs;
+	std::vector<glm::vec4> m_clipPositions; // Shaded vertices of the current indexed draw
+
+	NThreadPool* m_threadPool;
+	NOcclusionBuffer* m_occlusionBuffer;
+	AABB m_drawBounds;
+	BoundingSphere m_drawSphere;
+	bool m_hasDrawBounds;
+	std::vector<ResolveContextMT> m_resolveContexts; // One per bin
+
+	std::vector<VisibilityDraw> m_visibilityDraws; // Reused every frame
+	uint32_t m_numVisibilityDraws;
 
 	RenderState m_renderState;
+	RasterKernel::T m_supportedKernel;
+	RasterStats m_stats;
 
 	glm::mat4 m_curTransform;
 	glm::mat4 m_curView;
 	glm::mat4 m_curProjection;
 
 	static NRaster* m_instance;
-};
\ No newline at end of file
+};
+
+#include "NRasterPipeline.h"
@@ -0,0 +1,753 @@
+#pragma once
+
+/*
+  NRasterPipeline.h
+	Templated stages of the pipeline, included at the end of NRaster.h. Shaders are
+	functors and the state is a template parameter, so every combination gets its own
+	kernels with the shaders inlined. The function pointer shaders set with
+	NRaster::SetShaders run through the adapters below.
+*/
+
+#include <assert.h>
+#include <float.h>
+#include <immintrin.h>
+#if defined(_MSC_VER)
+	#define NRASTER_TARGET(isa)
+#else
+	// GCC and clang only emit the instructions of the ISA enabled for each function
+	#define NRASTER_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+// Runs the shaders set with NRaster::SetShaders, vertices go through the batched path
+struct VertexShaderFnAdapter
+{
+	VertexShaderFn VertexShader;
+	VertexBatchShaderFn VertexBatchShader;
+};
+
+struct PixelShaderFnAdapter
+{
+	glm::vec4 operator()(const Vertex& vertex) const
+	{
+		return PixelShader(vertex);
+	}
+
+	PixelShaderFn PixelShader;
+};
+
+// Used as the pixel shader of visibility buffer draws, stores the ids of the triangle
+struct VisibilityWriter
+{
+	VisibilityId* VisibilityBuffer;
+	uint32_t DrawId;
+	uint32_t TriangleId;
+};
+
+// Pixel shader of depth only draws, nothing but the depth buffer is written
+struct NoPixelShader
+{
+};
+
+// Pixel shaders that don't read the interpolated attributes, their setup is skipped
+template<typename PS>
+struct NeedsAttributes
+{
+	static const bool Value = true;
+};
+
+template<>
+struct NeedsAttributes<NoPixelShader>
+{
+	static const bool Value = false;
+};
+
+template<>
+struct NeedsAttributes<VisibilityWriter>
+{
+	static const bool Value = false;
+};
+
+template<DepthTest::T kDepthTest>
+inline bool DepthTestPasses(float depth, float prevDepth)
+{
+	switch (kDepthTest)
+	{
+	case DepthTest::Equal:
+		return depth == prevDepth;
+	default:
+		return depth < prevDepth;
+	}
+}
+
+template<DepthTest::T kDepthTest>
+NRASTER_TARGET("sse4.1") inline __m128 DepthTestSSE41(__m128 depth, __m128 prevDepth)
+{
+	switch (kDepthTest)
+	{
+	case DepthTest::Equal:
+		return _mm_cmpeq_ps(depth, prevDepth);
+	default:
+		return _mm_cmplt_ps(depth, prevDepth);
+	}
+}
+
+template<DepthTest::T kDepthTest>
+NRASTER_TARGET("avx2") inline __m256 DepthTestAVX2(__m256 depth, __m256 prevDepth)
+{
+	switch (kDepthTest)
+	{
+	case DepthTest::Equal:
+		return _mm256_cmp_ps(depth, prevDepth, _CMP_EQ_OQ);
+	default:
+		return _mm256_cmp_ps(depth, prevDepth, _CMP_LT_OQ);
+	}
+}
+
+struct BlockCoverage
+{
+	enum T
+	{
+		Outside,
+		Inside,
+		Partial
+	};
+};
+
+inline BlockCoverage::T ClassifyBlock(const TriangleSetup& setup, const glm::ivec4& block)
+{
+	// Centers of the corner pixels of the block
+	int64_t x0 = ((int64_t)block.x * kSubPixelSteps) + kSubPixelHalf;
+	int64_t y0 = ((int64_t)block.y * kSubPixelSteps) + kSubPixelHalf;
+	int64_t dx = (int64_t)(block.z - block.x) * kSubPixelSteps;
+	int64_t dy = (int64_t)(block.w - block.y) * kSubPixelSteps;
+
+	// Edge functions are linear, so their min and max over the block are at the corners
+	bool inside = true;
+	for (int i = 0; i < 3; ++i)
+	{
+		const TriangleEdge& edge = setup.Edges[i];
+		int64_t corner = edge.A * x0 + edge.B * y0 + edge.C;
+		int64_t stepX = edge.A * dx;
+		int64_t stepY = edge.B * dy;
+		int64_t maxE = corner + glm::max(stepX, (int64_t)0) + glm::max(stepY, (int64_t)0);
+		if (maxE < 0)
+		{
+			return BlockCoverage::Outside;
+		}
+		int64_t minE = corner + glm::min(stepX, (int64_t)0) + glm::min(stepY, (int64_t)0);
+		inside = inside && (minE >= 0);
+	}
+	return inside ? BlockCoverage::Inside : BlockCoverage::Partial;
+}
+
+// True if no depth in front of minDepth can pass the test against a region with this max depth
+template<DepthTest::T kDepthTest>
+inline bool HiZRejects(float minDepth, float maxDepth)
+{
+	switch (kDepthTest)
+	{
+	case DepthTest::Equal:
+		return minDepth > maxDepth;
+	default:
+		return minDepth >= maxDepth;
+	}
+}
+
+// Conservative min depth of the triangle over the block, bias included
+inline float BlockMinDepth(const TriangleSetup& setup, const glm::ivec4& block)
+{
+	// Depth is linear in screen space, so its min over the block is at one of the corners. The
+	// plane keeps going past the edges, clamp it to the depths of the triangle.
+	const PlaneEquation& plane = setup.Depth;
+	double x0 = (double)plane.A * (block.x - setup.Bounds.x);
+	double x1 = (double)plane.A * (block.z - setup.Bounds.x);
+	double y0 = (double)plane.B * (block.y - setup.Bounds.y);
+	double y1 = (double)plane.B * (block.w - setup.Bounds.y);
+	double minDepth = plane.C + glm::min(x0, x1) + glm::min(y0, y1);
+	return glm::max((float)minDepth, setup.MinDepth) - kHiZDepthBias;
+}
+
+inline float GetTileMaxDepth(const HiZBuffer& hiZ, int x, int y)
+{
+	int tileSize = hiZ.BlocksPerTile * kRasterBlockSize;
+	return hiZ.TileMaxDepth[(y / tileSize) * hiZ.NumTilesWidth + x / tileSize];
+}
+
+// Max of the depth buffer over the screen aligned block at bx, by
+inline float ComputeBlockMaxDepth(const RenderState& renderState, int bx, int by)
+{
+	int width = renderState.RtSize.z;
+	int endX = glm::min(bx + kRasterBlockSize, width);
+	int endY = glm::min(by + kRasterBlockSize, (int)renderState.RtSize.w);
+	if (endX - bx == kRasterBlockSize)
+	{
+		// Two 4 wide loads per row, plain SSE needs no dispatch
+		__m128 maxDepth = _mm_set1_ps(-FLT_MAX);
+		for (int y = by; y < endY; ++y)
+		{
+			const float* depthRow = &renderState.DepthBuffer[y * width + bx];
+			maxDepth = _mm_max_ps(maxDepth, _mm_max_ps(_mm_loadu_ps(depthRow), _mm_loadu_ps(depthRow + 4)));
+		}
+		maxDepth = _mm_max_ps(maxDepth, _mm_shuffle_ps(maxDepth, maxDepth, _MM_SHUFFLE(1, 0, 3, 2)));
+		maxDepth = _mm_max_ps(maxDepth, _mm_shuffle_ps(maxDepth, maxDepth, _MM_SHUFFLE(2, 3, 0, 1)));
+		return _mm_cvtss_f32(maxDepth);
+	}
+
+	float maxDepth = -FLT_MAX;
+	for (int y = by; y < endY; ++y)
+	{
+		const float* depthRow = &renderState.DepthBuffer[y * width];
+		for (int x = bx; x < endX; ++x)
+		{
+			maxDepth = glm::max(maxDepth, depthRow[x]);
+		}
+	}
+	return maxDepth;
+}
+
+inline float EvaluatePlane(const PlaneEquation& plane, float x, float y)
+{
+	return plane.A * x + plane.B * y + plane.C;
+}
+
+inline void ShadePixel(const VisibilityWriter& writer, const TriangleSetup&, float, float, PixelRGBA32*, uint32_t pixelIndex)
+{
+	writer.VisibilityBuffer[pixelIndex].DrawId = writer.DrawId;
+	writer.VisibilityBuffer[pixelIndex].TriangleId = writer.TriangleId;
+}
+
+inline void ShadePixel(const NoPixelShader&, const TriangleSetup&, float, float, PixelRGBA32*, uint32_t)
+{
+}
+
+// x and y are relative to the first pixel of the triangle bounds, like the planes
+template<typename PS>
+inline void ShadePixel(const PS& pixelShader, const TriangleSetup& setup, float x, float y, PixelRGBA32* pixels, uint32_t pixelIndex)
+{
+	// Perspective correct attributes:
+	float pixelW = 1.0f / EvaluatePlane(setup.InvW, x, y);
+	Vertex interpolatedData;
+	interpolatedData.Normal = glm::vec3(EvaluatePlane(setup.Normals[0], x, y), EvaluatePlane(setup.Normals[1], x, y), EvaluatePlane(setup.Normals[2], x, y)) * pixelW;
+	interpolatedData.TexCoord = glm::vec2(EvaluatePlane(setup.TexCoords[0], x, y), EvaluatePlane(setup.TexCoords[1], x, y)) * pixelW;
+
+	// Pixel shader:
+	glm::vec4 pixel = pixelShader(interpolatedData);
+
+	// Pixel color:
+	PixelRGBA32& outPixel = pixels[pixelIndex];
+	outPixel.R = (uint8_t)(pixel.r * 255.0f);
+	outPixel.G = (uint8_t)(pixel.g * 255.0f);
+	outPixel.B = (uint8_t)(pixel.b * 255.0f);
+	outPixel.A = (uint8_t)(pixel.a * 255.0f);
+}
+
+// The pixel loops return the number of pixels that passed the depth test. Depth is the plane
+// evaluated as A * x + (B * y + C), the vector kernels do the same so they all match.
+template<typename PS, DepthTest::T kDepthTest, bool kDepthWrite, bool kTestEdges>
+inline uint32_t RasterSpanScalar(const PS& pixelShader, const TriangleSetup& setup, int sx, int endX, int64_t e0, int64_t e1, int64_t e2, float y, float rowDepth, PixelRGBA32* pixels, uint32_t rowOffset, float* curDepthRow)
+{
+	uint32_t numPassed = 0;
+	const TriangleEdge* edges = setup.Edges;
+	int64_t stepX0 = edges[0].A * kSubPixelSteps;
+	int64_t stepX1 = edges[1].A * kSubPixelSteps;
+	int64_t stepX2 = edges[2].A * kSubPixelSteps;
+
+	for (; sx <= endX; ++sx, e0 += stepX0, e1 += stepX1, e2 += stepX2)
+	{
+		// Inside if all the edge functions are positive
+		if (!kTestEdges || (e0 | e1 | e2) >= 0)
+		{
+			// Depth test:
+			float x = (float)(sx - setup.Bounds.x);
+			float pixelDepth = setup.Depth.A * x + rowDepth;
+			if (DepthTestPasses<kDepthTest>(pixelDepth, curDepthRow[sx]))
+			{
+				// Update depth buffer:
+				if (kDepthWrite)
+				{
+					curDepthRow[sx] = pixelDepth;
+				}
+
+				ShadePixel(pixelShader, setup, x, y, pixels, rowOffset + sx);
+				++numPassed;
+			}
+		}
+	}
+	return numPassed;
+}
+
+template<typename PS, DepthTest::T kDepthTest, bool kDepthWrite, bool kTestEdges>
+uint32_t RasterBlockScalar(const RenderState& renderState, const PS& pixelShader, const TriangleSetup& setup, const glm::ivec4& span)
+{
+	int width = renderState.RtSize.z;
+	PixelRGBA32* pixels = renderState.RenderTarget;
+	float* depthBuffer = renderState.DepthBuffer;
+	const TriangleEdge* edges = setup.Edges;
+	uint32_t numPassed = 0;
+
+	// Edge values at the center of the first pixel. They are exact, so it doesn't
+	// matter from which tile we start walking the triangle.
+	int64_t startX = ((int64_t)span.x * kSubPixelSteps) + kSubPixelHalf;
+	int64_t startY = ((int64_t)span.y * kSubPixelSteps) + kSubPixelHalf;
+	int64_t row0 = edges[0].A * startX + edges[0].B * startY + edges[0].C;
+	int64_t row1 = edges[1].A * startX + edges[1].B * startY + edges[1].C;
+	int64_t row2 = edges[2].A * startX + edges[2].B * startY + edges[2].C;
+
+	// Moving one pixel is kSubPixelSteps in the fixed grid
+	int64_t stepY0 = edges[0].B * kSubPixelSteps;
+	int64_t stepY1 = edges[1].B * kSubPixelSteps;
+	int64_t stepY2 = edges[2].B * kSubPixelSteps;
+
+	for (int sy = span.y; sy <= span.w; ++sy)
+	{
+		uint32_t rowOffset = sy * width;
+		float y = (float)(sy - setup.Bounds.y);
+		float rowDepth = setup.Depth.B * y + setup.Depth.C;
+		numPassed += RasterSpanScalar<PS, kDepthTest, kDepthWrite, kTestEdges>(pixelShader, setup, span.x, span.z, row0, row1, row2, y, rowDepth, pixels, rowOffset, &depthBuffer[rowOffset]);
+
+		row0 += stepY0;
+		row1 += stepY1;
+		row2 += stepY2;
+	}
+	return numPassed;
+}
+
+template<typename PS, DepthTest::T kDepthTest, bool kDepthWrite, bool kTestEdges>
+NRASTER_TARGET("sse4.1") uint32_t RasterBlockSSE41(const RenderState& renderState, const PS& pixelShader, const TriangleSetup& setup, const glm::ivec4& span)
+{
+	int width = renderState.RtSize.z;
+	PixelRGBA32* pixels = renderState.RenderTarget;
+	float* depthBuffer = renderState.DepthBuffer;
+	const TriangleEdge* edges = setup.Edges;
+	uint32_t numPassed = 0;
+
+	int64_t startX = ((int64_t)span.x * kSubPixelSteps) + kSubPixelHalf;
+	int64_t startY = ((int64_t)span.y * kSubPixelSteps) + kSubPixelHalf;
+	int64_t row0 = edges[0].A * startX + edges[0].B * startY + edges[0].C;
+	int64_t row1 = edges[1].A * startX + edges[1].B * startY + edges[1].C;
+	int64_t row2 = edges[2].A * startX + edges[2].B * startY + edges[2].C;
+	int64_t stepY0 = edges[0].B * kSubPixelSteps;
+	int64_t stepY1 = edges[1].B * kSubPixelSteps;
+	int64_t stepY2 = edges[2].B * kSubPixelSteps;
+
+	// Edge offsets of the 4 pixels of a block, and the step to the next block
+	const __m128i laneIdx = _mm_setr_epi32(0, 1, 2, 3);
+	const __m128i laneStep0 = _mm_mullo_epi32(laneIdx, _mm_set1_epi32(edges[0].A * kSubPixelSteps));
+	const __m128i laneStep1 = _mm_mullo_epi32(laneIdx, _mm_set1_epi32(edges[1].A * kSubPixelSteps));
+	const __m128i laneStep2 = _mm_mullo_epi32(laneIdx, _mm_set1_epi32(edges[2].A * kSubPixelSteps));
+	const __m128i blockStep0 = _mm_set1_epi32(edges[0].A * (kSubPixelSteps * 4));
+	const __m128i blockStep1 = _mm_set1_epi32(edges[1].A * (kSubPixelSteps * 4));
+	const __m128i blockStep2 = _mm_set1_epi32(edges[2].A * (kSubPixelSteps * 4));
+
+	// Pixel x relative to the planes, whole numbers so stepping it is exact
+	const __m128 depthA = _mm_set1_ps(setup.Depth.A);
+	const __m128 laneX = _mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32(span.x - setup.Bounds.x), laneIdx));
+	const __m128 blockStepX = _mm_set1_ps(4.0f);
+
+	for (int sy = span.y; sy <= span.w; ++sy)
+	{
+		uint32_t rowOffset = sy * width;
+		float* curDepthRow = &depthBuffer[rowOffset];
+		float y = (float)(sy - setup.Bounds.y);
+		float rowDepth = setup.Depth.B * y + setup.Depth.C;
+		__m128 rowDepth4 = _mm_set1_ps(rowDepth);
+
+		__m128i e0 = _mm_add_epi32(_mm_set1_epi32((int32_t)row0), laneStep0);
+		__m128i e1 = _mm_add_epi32(_mm_set1_epi32((int32_t)row1), laneStep1);
+		__m128i e2 = _mm_add_epi32(_mm_set1_epi32((int32_t)row2), laneStep2);
+		__m128 x = laneX;
+
+		int sx = span.x;
+		for (; sx + 3 <= span.z; sx += 4)
+		{
+			// Inside if all the edge functions are positive, the sign bit tells us
+			__m128i edgeSigns = _mm_or_si128(_mm_or_si128(e0, e1), e2);
+			int coverageMask = kTestEdges ? (~_mm_movemask_ps(_mm_castsi128_ps(edgeSigns)) & 0xf) : 0xf;
+			if (coverageMask)
+			{
+				// Depth test:
+				__m128 pixelDepth = _mm_add_ps(_mm_mul_ps(depthA, x), rowDepth4);
+				__m128 prevDepth = _mm_loadu_ps(&curDepthRow[sx]);
+				__m128 passed = DepthTestSSE41<kDepthTest>(pixelDepth, prevDepth);
+				if (kTestEdges)
+				{
+					passed = _mm_and_ps(passed, _mm_castsi128_ps(_mm_cmpgt_epi32(edgeSigns, _mm_set1_epi32(-1))));
+				}
+				int passedMask = _mm_movemask_ps(passed);
+				if (passedMask)
+				{
+					// Update depth buffer:
+					if (kDepthWrite)
+					{
+						_mm_storeu_ps(&curDepthRow[sx], _mm_blendv_ps(prevDepth, pixelDepth, passed));
+					}
+
+					float blockX = (float)(sx - setup.Bounds.x);
+					for (int lane = 0; lane < 4; ++lane)
+					{
+						if (passedMask & (1 << lane))
+						{
+							ShadePixel(pixelShader, setup, blockX + lane, y, pixels, rowOffset + sx + lane);
+							++numPassed;
+						}
+					}
+				}
+			}
+
+			e0 = _mm_add_epi32(e0, blockStep0);
+			e1 = _mm_add_epi32(e1, blockStep1);
+			e2 = _mm_add_epi32(e2, blockStep2);
+			x = _mm_add_ps(x, blockStepX);
+		}
+
+		// Remaining pixels of the row
+		numPassed += RasterSpanScalar<PS, kDepthTest, kDepthWrite, kTestEdges>(pixelShader, setup, sx, span.z, _mm_cvtsi128_si32(e0), _mm_cvtsi128_si32(e1), _mm_cvtsi128_si32(e2), y, rowDepth, pixels, rowOffset, curDepthRow);
+
+		row0 += stepY0;
+		row1 += stepY1;
+		row2 += stepY2;
+	}
+	return numPassed;
+}
+
+template<typename PS, DepthTest::T kDepthTest, bool kDepthWrite, bool kTestEdges>
+NRASTER_TARGET("avx2") uint32_t RasterBlockAVX2(const RenderState& renderState, const PS& pixelShader, const TriangleSetup& setup, const glm::ivec4& span)
+{
+	int width = renderState.RtSize.z;
+	PixelRGBA32* pixels = renderState.RenderTarget;
+	float* depthBuffer = renderState.DepthBuffer;
+	const TriangleEdge* edges = setup.Edges;
+	uint32_t numPassed = 0;
+
+	int64_t startX = ((int64_t)span.x * kSubPixelSteps) + kSubPixelHalf;
+	int64_t startY = ((int64_t)span.y * kSubPixelSteps) + kSubPixelHalf;
+	int64_t row0 = edges[0].A * startX + edges[0].B * startY + edges[0].C;
+	int64_t row1 = edges[1].A * startX + edges[1].B * startY + edges[1].C;
+	int64_t row2 = edges[2].A * startX + edges[2].B * startY + edges[2].C;
+	int64_t stepY0 = edges[0].B * kSubPixelSteps;
+	int64_t stepY1 = edges[1].B * kSubPixelSteps;
+	int64_t stepY2 = edges[2].B * kSubPixelSteps;
+
+	// Edge offsets of the 8 pixels of a block, and the step to the next block
+	const __m256i laneIdx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i laneStep0 = _mm256_mullo_epi32(laneIdx, _mm256_set1_epi32(edges[0].A * kSubPixelSteps));
+	const __m256i laneStep1 = _mm256_mullo_epi32(laneIdx, _mm256_set1_epi32(edges[1].A * kSubPixelSteps));
+	const __m256i laneStep2 = _mm256_mullo_epi32(laneIdx, _mm256_set1_epi32(edges[2].A * kSubPixelSteps));
+	const __m256i blockStep0 = _mm256_set1_epi32(edges[0].A * (kSubPixelSteps * 8));
+	const __m256i blockStep1 = _mm256_set1_epi32(edges[1].A * (kSubPixelSteps * 8));
+	const __m256i blockStep2 = _mm256_set1_epi32(edges[2].A * (kSubPixelSteps * 8));
+
+	// Pixel x relative to the planes, whole numbers so stepping it is exact
+	const __m256 depthA = _mm256_set1_ps(setup.Depth.A);
+	const __m256 laneX = _mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(span.x - setup.Bounds.x), laneIdx));
+	const __m256 blockStepX = _mm256_set1_ps(8.0f);
+
+	for (int sy = span.y; sy <= span.w; ++sy)
+	{
+		uint32_t rowOffset = sy * width;
+		float* curDepthRow = &depthBuffer[rowOffset];
+		float y = (float)(sy - setup.Bounds.y);
+		float rowDepth = setup.Depth.B * y + setup.Depth.C;
+		__m256 rowDepth8 = _mm256_set1_ps(rowDepth);
+
+		__m256i e0 = _mm256_add_epi32(_mm256_set1_epi32((int32_t)row0), laneStep0);
+		__m256i e1 = _mm256_add_epi32(_mm256_set1_epi32((int32_t)row1), laneStep1);
+		__m256i e2 = _mm256_add_epi32(_mm256_set1_epi32((int32_t)row2), laneStep2);
+		__m256 x = laneX;
+
+		int sx = span.x;
+		for (; sx + 7 <= span.z; sx += 8)
+		{
+			// Inside if all the edge functions are positive, the sign bit tells us
+			__m256i edgeSigns = _mm256_or_si256(_mm256_or_si256(e0, e1), e2);
+			int coverageMask = kTestEdges ? (~_mm256_movemask_ps(_mm256_castsi256_ps(edgeSigns)) & 0xff) : 0xff;
+			if (coverageMask)
+			{
+				// Depth test. No FMAs, so the results match the scalar path:
+				__m256 pixelDepth = _mm256_add_ps(_mm256_mul_ps(depthA, x), rowDepth8);
+				__m256 prevDepth = _mm256_loadu_ps(&curDepthRow[sx]);
+				__m256i passed = _mm256_castps_si256(DepthTestAVX2<kDepthTest>(pixelDepth, prevDepth));
+				if (kTestEdges)
+				{
+					passed = _mm256_and_si256(passed, _mm256_cmpgt_epi32(edgeSigns, _mm256_set1_epi32(-1)));
+				}
+				int passedMask = _mm256_movemask_ps(_mm256_castsi256_ps(passed));
+				if (passedMask)
+				{
+					// Update depth buffer:
+					if (kDepthWrite)
+					{
+						_mm256_maskstore_ps(&curDepthRow[sx], passed, pixelDepth);
+					}
+
+					float blockX = (float)(sx - setup.Bounds.x);
+					for (int lane = 0; lane < 8; ++lane)
+					{
+						if (passedMask & (1 << lane))
+						{
+							ShadePixel(pixelShader, setup, blockX + lane, y, pixels, rowOffset + sx + lane);
+							++numPassed;
+						}
+					}
+				}
+			}
+
+			e0 = _mm256_add_epi32(e0, blockStep0);
+			e1 = _mm256_add_epi32(e1, blockStep1);
+			e2 = _mm256_add_epi32(e2, blockStep2);
+			x = _mm256_add_ps(x, blockStepX);
+		}
+
+		// Remaining pixels of the row
+		numPassed += RasterSpanScalar<PS, kDepthTest, kDepthWrite, kTestEdges>(pixelShader, setup, sx, span.z, _mm_cvtsi128_si32(_mm256_castsi256_si128(e0)), _mm_cvtsi128_si32(_mm256_castsi256_si128(e1)), _mm_cvtsi128_si32(_mm256_castsi256_si128(e2)), y, rowDepth, pixels, rowOffset, curDepthRow);
+
+		row0 += stepY0;
+		row1 += stepY1;
+		row2 += stepY2;
+	}
+	return numPassed;
+}
+
+template<typename PS, DepthTest::T kDepthTest, bool kDepthWrite>
+uint32_t NRaster::RasterBlocks(const RenderState& renderState, const PS& pixelShader, const TriangleSetup& setup, RasterStats& stats)
+{
+	// Intersect the bounds with the half open screen rect [x, x + w) x [y, y + h) once, so the
+	// pixel loops don't clip. Tiles don't overlap, every pixel is owned by a single one.
+	const glm::ivec4& rect = renderState.ScreenRect;
+	glm::ivec4 span;
+	span.x = glm::max(setup.Bounds.x, rect.x);
+	span.y = glm::max(setup.Bounds.y, rect.y);
+	span.z = glm::min(setup.Bounds.z, rect.x + rect.z - 1);
+	span.w = glm::min(setup.Bounds.w, rect.y + rect.w - 1);
+	if (span.x > span.z || span.y > span.w)
+	{
+		return 0;
+	}
+
+	// The vector kernels step the edge functions with 32 bit lanes
+	RasterKernel::T kernel = setup.Fits32Bits ? renderState.Kernel : RasterKernel::Scalar;
+
+	// Blocks are tested against the Hi-Z before rasterizing them and update it after
+	const HiZBuffer& hiZ = renderState.HiZ;
+	bool hiZChanged = false;
+
+	// Walk the span in screen aligned blocks. Blocks outside of any edge are skipped and
+	// blocks inside all of them are filled without per pixel edge tests.
+	uint32_t numPassed = 0;
+	for (int by = span.y & ~(kRasterBlockSize - 1); by <= span.w; by += kRasterBlockSize)
+	{
+		for (int bx = span.x & ~(kRasterBlockSize - 1); bx <= span.z; bx += kRasterBlockSize)
+		{
+			glm::ivec4 block;
+			block.x = glm::max(bx, span.x);
+			block.y = glm::max(by, span.y);
+			block.z = glm::min(bx + kRasterBlockSize - 1, span.z);
+			block.w = glm::min(by + kRasterBlockSize - 1, span.w);
+
+			BlockCoverage::T coverage = ClassifyBlock(setup, block);
+			if (coverage == BlockCoverage::Outside)
+			{
+				++stats.BlocksRejected;
+				continue;
+			}
+
+			float* blockMaxDepth = nullptr;
+			if (hiZ.BlockMaxDepth)
+			{
+				// Only worth testing if the block isn't behind the whole triangle
+				blockMaxDepth = &hiZ.BlockMaxDepth[(by / kRasterBlockSize) * hiZ.NumBlocksWidth + bx / kRasterBlockSize];
+				if (*blockMaxDepth <= setup.MaxDepth && HiZRejects<kDepthTest>(BlockMinDepth(setup, block), *blockMaxDepth))
+				{
+					++stats.BlocksHiZCulled;
+					continue;
+				}
+			}
+
+			bool testEdges = coverage == BlockCoverage::Partial;
+			if (testEdges)
+			{
+				++stats.BlocksPartial;
+			}
+			else
+			{
+				++stats.BlocksAccepted;
+			}
+
+			uint32_t blockPassed = 0;
+			switch (kernel)
+			{
+			case RasterKernel::AVX2:
+				blockPassed = testEdges ? RasterBlockAVX2<PS, kDepthTest, kDepthWrite, true>(renderState, pixelShader, setup, block) : RasterBlockAVX2<PS, kDepthTest, kDepthWrite, false>(renderState, pixelShader, setup, block);
+				break;
+			case RasterKernel::SSE41:
+				blockPassed = testEdges ? RasterBlockSSE41<PS, kDepthTest, kDepthWrite, true>(renderState, pixelShader, setup, block) : RasterBlockSSE41<PS, kDepthTest, kDepthWrite, false>(renderState, pixelShader, setup, block);
+				break;
+			default:
+				blockPassed = testEdges ? RasterBlockScalar<PS, kDepthTest, kDepthWrite, true>(renderState, pixelShader, setup, block) : RasterBlockScalar<PS, kDepthTest, kDepthWrite, false>(renderState, pixelShader, setup, block);
+				break;
+			}
+			numPassed += blockPassed;
+
+			// Written depths can only be closer, the max of the block may have moved forward. The
+			// tiles only need updating if it was one of the blocks holding their max.
+			if (kDepthWrite && blockMaxDepth && blockPassed > 0)
+			{
+				float prevMaxDepth = *blockMaxDepth;
+				*blockMaxDepth = ComputeBlockMaxDepth(renderState, bx, by);
+				hiZChanged = hiZChanged || (*blockMaxDepth < prevMaxDepth && prevMaxDepth >= GetTileMaxDepth(hiZ, bx, by));
+			}
+		}
+	}
+	if (hiZChanged)
+	{
+		UpdateHiZTiles(renderState, span);
+	}
+	return numPassed;
+}
+
+// The triangle id is only used by the visibility buffer, it is in the signature to share DrawPipeline::Raster
+template<typename PS, DepthTest::T kDepthTest, bool kDepthWrite>
+void NRaster::RasterTriangle(const RenderState& renderState, const TriangleSetup& setup, uint32_t, RasterStats& stats)
+{
+	const PS& pixelShader = *(const PS*)renderState.PixelShaderObject;
+	uint32_t numPassed = RasterBlocks<PS, kDepthTest, kDepthWrite>(renderState, pixelShader, setup, stats);
+	if (NeedsAttributes<PS>::Value)
+	{
+		stats.PixelShaderInvocations += numPassed;
+	}
+}
+
+template<DepthTest::T kDepthTest, bool kDepthWrite>
+void NRaster::RasterTriangleVisibility(const RenderState& renderState, const TriangleSetup& setup, uint32_t triangleId, RasterStats& stats)
+{
+	VisibilityWriter writer = { renderState.VisibilityBuffer, renderState.DrawId, triangleId };
+	RasterBlocks<VisibilityWriter, kDepthTest, kDepthWrite>(renderState, writer, setup, stats);
+}
+
+template<typename PS>
+void NRaster::ResolveVisibilitySpan(const RenderState& renderState, const VisibilityDraw& draw, int x, int endX, int y)
+{
+	const PS& pixelShader = *(const PS*)draw.PixelShader;
+	uint32_t rowOffset = y * renderState.ScreenRect.z;
+	const VisibilityId* ids = &renderState.VisibilityBuffer[rowOffset];
+
+	// Same setup the triangle was rasterized with, so the attributes match the forward path
+	for (int sx = x; sx <= endX; ++sx)
+	{
+		const TriangleSetup& setup = draw.Triangles[ids[sx].TriangleId];
+		ShadePixel(pixelShader, setup, (float)(sx - setup.Bounds.x), (float)(y - setup.Bounds.y), renderState.RenderTarget, rowOffset + sx);
+	}
+}
+
+template<typename PS>
+void* NRaster::ClonePixelShader(const void* pixelShader)
+{
+	return new PS(*(const PS*)pixelShader);
+}
+
+template<typename PS>
+void NRaster::DeletePixelShader(void* pixelShader)
+{
+	delete (PS*)pixelShader;
+}
+
+// Defined in NRaster.cpp, gathers the vertices in streams for the batched shaders
+template<>
+void NRaster::ShadeVertices<VertexShaderFnAdapter>(GeometryContext& context, const Vertex* vertices, uint32_t numVertices, glm::vec4* outPositions) const;
+
+template<typename VS>
+void NRaster::ShadeVertices(GeometryContext& context, const Vertex* vertices, uint32_t numVertices, glm::vec4* outPositions) const
+{
+	const VS& vertexShader = *(const VS*)context.Pipeline->VertexShader;
+	const VertexShaderUniforms& uniforms = *context.Uniforms;
+	for (uint32_t i = 0; i < numVertices; ++i)
+	{
+		outPositions[i] = vertexShader(vertices[i], uniforms);
+	}
+	context.Stats.VertexShaderInvocations += numVertices;
+}
+
+template<typename VS>
+void NRaster::ShadeVerticesMT(void* geometryContext)
+{
+	GeometryContext* context = (GeometryContext*)geometryContext;
+	uint32_t first = context->FirstVertex;
+	context->Raster->ShadeVertices<VS>(*context, &context->Vertices[first], context->LastVertex - first, &context->ClipPositions[first]);
+}
+
+template<typename VS, WindingOrder::T kWinding>
+void NRaster::ProcessGeometryMT(void* geometryContext)
+{
+	GeometryContext* context = (GeometryContext*)geometryContext;
+	context->Raster->ProcessGeometry<VS, kWinding>(*context);
+}
+
+template<typename VS, WindingOrder::T kWinding>
+void NRaster::ProcessGeometry(GeometryContext& context) const
+{
+	// Raster space has y pointing down, front faces are swapped to the order SetupTriangle expects
+	const uint32_t second = kWinding == WindingOrder::CCW ? 2 : 1;
+	const uint32_t third = kWinding == WindingOrder::CCW ? 1 : 2;
+
+	Vertex clipVerts[3];
+	if (context.Indices)
+	{
+		for (uint32_t i = context.FirstCorner; i < context.LastCorner; i += 3)
+		{
+			const uint32_t corners[3] = { context.Indices[i + 0], context.Indices[i + second], context.Indices[i + third] };
+			for (int v = 0; v < 3; ++v)
+			{
+				assert(corners[v] < context.NumVertices);
+				clipVerts[v] = context.Vertices[corners[v]];
+				clipVerts[v].Position = context.ClipPositions[corners[v]];
+			}
+			ProcessTriangle(clipVerts, context);
+		}
+		return;
+	}
+
+	// Shade a batch of triangles at a time
+	glm::vec4 positions[kVertexBatchSize];
+	for (uint32_t first = context.FirstCorner; first < context.LastCorner; first += kVertexBatchSize)
+	{
+		uint32_t count = glm::min(kVertexBatchSize, context.LastCorner - first);
+		ShadeVertices<VS>(context, &context.Vertices[first], count, positions);
+		for (uint32_t i = 0; i < count; i += 3)
+		{
+			clipVerts[0] = context.Vertices[first + i + 0];
+			clipVerts[1] = context.Vertices[first + i + second];
+			clipVerts[2] = context.Vertices[first + i + third];
+			clipVerts[0].Position = positions[i + 0];
+			clipVerts[1].Position = positions[i + second];
+			clipVerts[2].Position = positions[i + third];
+			ProcessTriangle(clipVerts, context);
+		}
+	}
+}
+
+template<typename VS, typename PS, DepthTest::T kDepthTest, WindingOrder::T kWinding, bool kDepthWrite>
+void NRaster::Draw(const Vertex* vertices, uint32_t numVertices, const uint32_t* indices, uint32_t numIndices, const VS& vertexShader, const PS& pixelShader)
+{
+	DrawPipeline pipeline;
+	pipeline.ShadeVerticesJob = &NRaster::ShadeVerticesMT<VS>;
+	pipeline.ProcessGeometryJob = &NRaster::ProcessGeometryMT<VS, kWinding>;
+	pipeline.Raster = &NRaster::RasterTriangle<PS, kDepthTest, kDepthWrite>;
+	pipeline.DTest = kDepthTest;
+	pipeline.NeedsAttributes = NeedsAttributes<PS>::Value;
+	pipeline.VertexShader = &vertexShader;
+	pipeline.PixelShader = &pixelShader;
+	pipeline.ClonePixelShader = &NRaster::ClonePixelShader<PS>;
+	pipeline.DeletePixelShader = &NRaster::DeletePixelShader<PS>;
+	pipeline.Visibility = nullptr;
+	if (m_renderState.VisibilityBuffer && NeedsAttributes<PS>::Value)
+	{
+		// Shaded by ResolveVisibility, the functor of the draw is gone by then
+		VisibilityDraw& draw = AddVisibilityDraw();
+		draw.PixelShader = new PS(pixelShader);
+		draw.DeletePixelShader = &NRaster::DeletePixelShader<PS>;
+		draw.ResolveSpan = &NRaster::ResolveVisibilitySpan<PS>;
+		pipeline.Raster = &NRaster::RasterTriangleVisibility<kDepthTest, kDepthWrite>;
+		pipeline.Visibility = &draw;
+	}
+	DrawTriangles(vertices, numVertices, indices, indices ? numIndices : numVertices, pipeline);
+}
@@ -0,0 +1,268 @@
+#include "NThreadPool.h"
+#include "tinythread.h"
+#include <iostream>
+#include <assert.h>
+#include <chrono>
+
+NThreadPool::NThreadPool():
+	 m_nextWorker(0)
+	,m_queuedJobs(0)
+	,m_pendingJobs(0)
+	,m_quit(false)
+	,m_lock(nullptr)
+	,m_jobAvailable(nullptr)
+	,m_jobsDone(nullptr)
+{
+}
+
+NThreadPool::NThreadPool(const NThreadPool& other)
+{
+	assert(false);
+}
+
+NThreadPool::~NThreadPool()
+{
+	Shutdown();
+}
+
+bool NThreadPool::Initialize(uint32_t numWorkers)
+{
+	if (!m_workers.empty())
+	{
+		std::cout << "[NThreadPool][Initialize][Warning]: The pool is already running. \n";
+		return false;
+	}
+
+	m_lock = new tthread::mutex;
+	m_jobAvailable = new tthread::condition_variable;
+	m_jobsDone = new tthread::condition_variable;
+	m_nextWorker = 0;
+	m_queuedJobs = 0;
+	m_pendingJobs = 0;
+	m_quit = false;
+
+	// Create all the deques before starting any thread, as workers steal from each other
+	numWorkers = numWorkers > 0 ? numWorkers : 1;
+	for (uint32_t i = 0; i < numWorkers; ++i)
+	{
+		Worker* worker = new Worker;
+		worker->Pool = this;
+		worker->Index = i;
+		worker->Thread = nullptr;
+		worker->Lock = new tthread::mutex;
+		m_workers.push_back(worker);
+	}
+	ResetStats();
+	for (uint32_t i = 0; i < numWorkers; ++i)
+	{
+		m_workers[i]->Thread = new tthread::thread(NThreadPool::WorkerEntry, m_workers[i]);
+	}
+
+	std::cout << "[NThreadPool][Initialize][Info]: Started " << numWorkers << " workers." << std::endl;
+
+	return true;
+}
+
+void NThreadPool::Shutdown()
+{
+	if (m_workers.empty())
+	{
+		return;
+	}
+
+	// Let the workers finish what is queued and exit
+	{
+		tthread::lock_guard<tthread::mutex> guard(*m_lock);
+		m_quit = true;
+		m_jobAvailable->notify_all();
+	}
+	for (uint32_t i = 0; i < m_workers.size(); ++i)
+	{
+		m_workers[i]->Thread->join();
+		delete m_workers[i]->Thread;
+	}
+	for (uint32_t i = 0; i < m_workers.size(); ++i)
+	{
+		delete m_workers[i]->Lock;
+		delete m_workers[i];
+	}
+	m_workers.clear();
+
+	delete m_jobsDone;
+	delete m_jobAvailable;
+	delete m_lock;
+	m_jobsDone = nullptr;
+	m_jobAvailable = nullptr;
+	m_lock = nullptr;
+}
+
+void NThreadPool::Submit(JobFn job, void* jobData, JobGroup* group)
+{
+	Job newJob;
+	newJob.Fn = job;
+	newJob.Data = jobData;
+	newJob.Group = group;
+
+	tthread::lock_guard<tthread::mutex> guard(*m_lock);
+
+	// Round robin between the workers, stealing will fix any imbalance
+	Worker* worker = m_workers[m_nextWorker];
+	m_nextWorker = (m_nextWorker + 1) % m_workers.size();
+	{
+		tthread::lock_guard<tthread::mutex> workerGuard(*worker->Lock);
+		worker->Jobs.push_back(newJob);
+	}
+
+	++m_queuedJobs;
+	++m_pendingJobs;
+	if (group)
+	{
+		++group->PendingJobs;
+	}
+	m_jobAvailable->notify_one();
+}
+
+void NThreadPool::WaitIdle()
+{
+	tthread::lock_guard<tthread::mutex> guard(*m_lock);
+	while (m_pendingJobs > 0)
+	{
+		m_jobsDone->wait(*m_lock);
+	}
+}
+
+void NThreadPool::Wait(const JobGroup& group)
+{
+	tthread::lock_guard<tthread::mutex> guard(*m_lock);
+	while (group.PendingJobs > 0)
+	{
+		m_jobsDone->wait(*m_lock);
+	}
+}
+
+uint32_t NThreadPool::GetNumWorkers() const
+{
+	return (uint32_t)m_workers.size();
+}
+
+float NThreadPool::GetBusyTimeMS(uint32_t worker) const
+{
+	tthread::lock_guard<tthread::mutex> guard(*m_workers[worker]->Lock);
+	return m_workers[worker]->BusyTimeMS;
+}
+
+uint32_t NThreadPool::GetNumJobsRun(uint32_t worker) const
+{
+	tthread::lock_guard<tthread::mutex> guard(*m_workers[worker]->Lock);
+	return m_workers[worker]->NumJobsRun;
+}
+
+uint32_t NThreadPool::GetNumJobsStolen(uint32_t worker) const
+{
+	tthread::lock_guard<tthread::mutex> guard(*m_workers[worker]->Lock);
+	return m_workers[worker]->NumJobsStolen;
+}
+
+void NThreadPool::ResetStats()
+{
+	for (uint32_t i = 0; i < m_workers.size(); ++i)
+	{
+		tthread::lock_guard<tthread::mutex> guard(*m_workers[i]->Lock);
+		m_workers[i]->BusyTimeMS = 0.0f;
+		m_workers[i]->NumJobsRun = 0;
+		m_workers[i]->NumJobsStolen = 0;
+	}
+}
+
+void NThreadPool::WorkerEntry(void* worker)
+{
+	Worker* self = (Worker*)worker;
+	self->Pool->WorkerLoop(self);
+}
+
+bool NThreadPool::PopJob(Worker* worker, Job& job)
+{
+	bool found = false;
+	bool stolen = false;
+
+	// Own work first, newest job as it is the most likely to be warm in cache
+	{
+		tthread::lock_guard<tthread::mutex> guard(*worker->Lock);
+		if (!worker->Jobs.empty())
+		{
+			job = worker->Jobs.back();
+			worker->Jobs.pop_back();
+			found = true;
+		}
+	}
+
+	// Steal the oldest job from the other workers
+	for (uint32_t i = 1; i < m_workers.size() && !found; ++i)
+	{
+		Worker* victim = m_workers[(worker->Index + i) % m_workers.size()];
+		tthread::lock_guard<tthread::mutex> guard(*victim->Lock);
+		if (!victim->Jobs.empty())
+		{
+			job = victim->Jobs.front();
+			victim->Jobs.pop_front();
+			found = true;
+			stolen = true;
+		}
+	}
+	if (stolen)
+	{
+		tthread::lock_guard<tthread::mutex> guard(*worker->Lock);
+		++worker->NumJobsStolen;
+	}
+
+	if (found)
+	{
+		tthread::lock_guard<tthread::mutex> guard(*m_lock);
+		--m_queuedJobs;
+	}
+	return found;
+}
+
+void NThreadPool::WorkerLoop(Worker* worker)
+{
+	while (true)
+	{
+		Job job;
+		if (!PopJob(worker, job))
+		{
+			tthread::lock_guard<tthread::mutex> guard(*m_lock);
+			while (m_queuedJobs <= 0 && !m_quit)
+			{
+				m_jobAvailable->wait(*m_lock);
+			}
+			if (m_queuedJobs <= 0 && m_quit)
+			{
+				return;
+			}
+			continue;
+		}
+
+		// Not through NProfiler, its first use sleeps to measure the clock
+		auto tstart = std::chrono::high_resolution_clock::now();
+
+		job.Fn(job.Data);
+
+		auto tend = std::chrono::high_resolution_clock::now();
+		{
+			tthread::lock_guard<tthread::mutex> guard(*worker->Lock);
+			worker->BusyTimeMS += std::chrono::duration<float, std::milli>(tend - tstart).count();
+			++worker->NumJobsRun;
+		}
+
+		{
+			tthread::lock_guard<tthread::mutex> guard(*m_lock);
+			// Waiters of the pool and of the group share the condition, they check their own count
+			--m_pendingJobs;
+			bool groupDone = job.Group && --job.Group->PendingJobs == 0;
+			if (m_pendingJobs == 0 || groupDone)
+			{
+				m_jobsDone->notify_all();
+			}
+		}
+	}
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+/*
+  NThreadPool.h
+	Long lived worker threads. Every worker owns a job deque, jobs are spread
+	across them on submission and idle workers steal from the others, so uneven
+	jobs don't leave cores waiting. Workers sleep on a condition variable while
+	there is no work.
+*/
+
+#include <stdint.h>
+#include <vector>
+#include <deque>
+
+namespace tthread
+{
+	class thread;
+	class mutex;
+	class condition_variable;
+};
+
+typedef void(*JobFn)(void* jobData);
+
+class NThreadPool
+{
+public:
+	NThreadPool();
+	~NThreadPool();
+
+	bool Initialize(uint32_t numWorkers);
+	void Shutdown();
+
+	// Counts the jobs submitted with it that are not done yet, so they can be waited on
+	// while other jobs keep running.
+	struct JobGroup
+	{
+		JobGroup() : PendingJobs(0) {}
+		uint32_t PendingJobs;	// Guarded by the pool
+	};
+
+	// Queues a job, it will be executed by the first free worker.
+	void Submit(JobFn job, void* jobData, JobGroup* group = nullptr);
+	// Blocks the calling thread until all the submitted jobs are done.
+	void WaitIdle();
+	// Blocks the calling thread until the jobs of the group are done.
+	void Wait(const JobGroup& group);
+	uint32_t GetNumWorkers()const;
+
+	// Stats since the last reset. Can be read while jobs run, with frames in flight the workers
+	// are rarely idle, the jobs still running are just not counted yet.
+	float GetBusyTimeMS(uint32_t worker)const;
+	uint32_t GetNumJobsRun(uint32_t worker)const;
+	uint32_t GetNumJobsStolen(uint32_t worker)const;
+	void ResetStats();
+
+private:
+	NThreadPool(const NThreadPool& other);
+
+	struct Job
+	{
+		JobFn Fn;
+		void* Data;
+		JobGroup* Group;
+	};
+
+	struct Worker
+	{
+		NThreadPool* Pool;
+		uint32_t Index;
+		tthread::thread* Thread;
+		tthread::mutex* Lock;	// Guards Jobs and the stats
+		std::deque<Job> Jobs;
+
+		float BusyTimeMS;
+		uint32_t NumJobsRun;
+		uint32_t NumJobsStolen;
+	};
+
+	static void WorkerEntry(void* worker);
+	void WorkerLoop(Worker* worker);
+	bool PopJob(Worker* worker, Job& job);
+
+	std::vector<Worker*> m_workers;
+	uint32_t m_nextWorker;
+	int32_t m_queuedJobs;	// Jobs sitting in any deque
+	uint32_t m_pendingJobs;	// Jobs submitted and not finished yet
+	bool m_quit;
+
+	tthread::mutex* m_lock;
+	tthread::condition_variable* m_jobAvailable;
+	tthread::condition_variable* m_jobsDone;
+};
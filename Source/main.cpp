@@ -1,5 +1,8 @@
 #include <smmintrin.h>
 #include <iostream>
+#include <float.h>
+#include <string.h>
+#include <vector>
 #include <SDL.h>
 
 #include "NModel.h"
@@ -16,7 +19,11 @@ struct GraphicsContext
 	SDL_Renderer* Renderer;
 	SDL_Texture* Framebuffer;
 	SDL_Texture* DepthBufferDebug;
-	float* DepthBuffer;
+	float* DepthBuffer;	// Of the frame on screen
+	VisibilityId* VisibilityBuffer;
+	// Pipelined frames render into their own buffers, the previous one is shown
+	PixelRGBA32* FrameColor[2];
+	float* FrameDepth[2];
 
 	int Width = 1024;
 	int Height = 720;
@@ -31,7 +38,23 @@ void TestSDL(PixelRGBA32* pixels, int width, int height);
 void TestRaster(PixelRGBA32* pixels, int width, int height);
 bool PollEvents();
 
-void RenderScene(PixelRGBA32* pixels, int width, int height);
+// The depth prepass only writes depth, the shading pass then tests for equal depth
+struct ScenePass
+{
+	enum T
+	{
+		Forward,
+		DepthPrepass,
+		Shading,
+		Count
+	};
+};
+
+void RenderScene(PixelRGBA32* pixels, float* depthBuffer, int width, int height, bool templatedPipeline = false, bool depthPrepass = false, bool occlusionCulling = false);
+void DrawModel(NModel& model, bool templatedPipeline, ScenePass::T pass);
+void DrawModelTemplated(NModel& model, ScenePass::T pass);
+void BenchmarkModelLoading();
+void BenchmarkPipelines();
 
 NModel teapot;
 NModel cube;
@@ -41,26 +64,46 @@ int main(int, char**)
 	InitSDL();
 	InitWindowAndRenderer();
 
+	bool benchmarkLoading = false;
+	if (benchmarkLoading)
+	{
+		BenchmarkModelLoading();
+	}
+
 	teapot.LoadFromfile("../../Data/teapot.obj");
 	cube.LoadFromfile("../../Data/cube.obj");
 
 	NRaster::Instance()->Initialize();
 
+	bool benchmarkPipelines = false;
+	if (benchmarkPipelines)
+	{
+		BenchmarkPipelines();
+	}
+
+	// Shade every pixel once after all the draws
+	bool visibilityBuffer = false;
+	bool depthPrepass = false;
+	// Adds teapots hidden under the floor, culled against it as whole draws
+	bool occlusionCulling = false;
+	// Records a frame while the tiles of the previous one raster, it is shown a frame later
+	bool pipelined = false;
+	NRaster::Instance()->SetMaxFramesInFlight(pipelined ? 2 : 1);
+
+	uint32_t frame = 0;
 	bool exit = false;
 	while (!exit)
 	{
 		exit = PollEvents();
 
-		// Clear depth buffer
+		if (visibilityBuffer)
 		{
-			for (int y = 0; y < gContext.Height; ++y)
+			for (int i = 0; i < gContext.Width * gContext.Height; ++i)
 			{
-				for (int x = 0; x < gContext.Width; ++x)
-				{
-					gContext.DepthBuffer[y * gContext.Width + x] = 1.0f;
-				}
+				gContext.VisibilityBuffer[i].DrawId = kInvalidDrawId;
 			}
 		}
+		NRaster::Instance()->SetVisibilityBuffer(visibilityBuffer ? gContext.VisibilityBuffer : nullptr);
 
 		
 		// Rendering.
@@ -70,11 +113,14 @@ int main(int, char**)
 		int pitch = 0;
 		SDL_LockTexture(gContext.Framebuffer, NULL, &pData, &pitch);
 		{
+			// Straight to the texture unless pipelined
+			PixelRGBA32* pixels = pipelined ? gContext.FrameColor[frame % 2] : (PixelRGBA32*)pData;
+			float* depthBuffer = gContext.FrameDepth[pipelined ? frame % 2 : 0];
 			for (int y = 0; y < gContext.Height; ++y)
 			{
 				for (int x = 0; x < gContext.Width; ++x)
 				{
-					PixelRGBA32* cur = (PixelRGBA32*)pData;
+					PixelRGBA32* cur = pixels;
 					cur += y * gContext.Width + x;
 					
 					PixelRGBA32 clear;
@@ -88,10 +134,48 @@ int main(int, char**)
 
 			auto start = NProfilerGet()->Now();
 			
-			RenderScene((PixelRGBA32*)pData, gContext.Width, gContext.Height);
+			RenderScene(pixels, depthBuffer, gContext.Width, gContext.Height, false, depthPrepass, occlusionCulling);
+			if (visibilityBuffer)
+			{
+				NRaster::Instance()->ResolveVisibility();
+			}
+			gContext.DepthBuffer = depthBuffer;
+			if (pipelined)
+			{
+				// EndFrame waited for the previous frame to be done
+				int previous = (frame + 1) % 2;
+				memcpy(pData, gContext.FrameColor[previous], gContext.Width * gContext.Height * sizeof(PixelRGBA32));
+				gContext.DepthBuffer = gContext.FrameDepth[previous];
+			}
+			++frame;
 
 			auto end = NProfilerGet()->Now();
 			std::cout << NProfilerGet()->TimeDiffMS(start,end) << "ms.\n";
+
+			bool printStats = false;
+			if (printStats)
+			{
+				for (uint32_t w = 0; w < NRaster::Instance()->GetNumWorkers(); ++w)
+				{
+					std::cout << "  Worker " << w << ": " << NRaster::Instance()->GetWorkerBusyTimeMS(w) << "ms busy.\n";
+				}
+				const RasterStats& stats = NRaster::Instance()->GetStats();
+				std::cout << "  Draws frustum culled: " << stats.DrawsFrustumCulled << " occlusion culled: " << stats.DrawsOcclusionCulled << "\n";
+				std::cout << "  Vertex shader invocations: " << stats.VertexShaderInvocations << "\n";
+				int coveredPixels = 0;
+				for (int i = 0; i < gContext.Width * gContext.Height; ++i)
+				{
+					coveredPixels += gContext.DepthBuffer[i] < 1.0f ? 1 : 0;
+				}
+				std::cout << "  Pixel shader invocations: " << stats.PixelShaderInvocations << " (" << (float)stats.PixelShaderInvocations / glm::max(coveredPixels, 1) << " per covered pixel)\n";
+				std::cout << "  Triangles rejected: " << stats.TrianglesClipRejected << " clipped: " << stats.TrianglesClipped << " passed: " << stats.TrianglesClipPassed << " culled: " << stats.TrianglesCulled << " binned: " << stats.TrianglesBinned << "\n";
+				std::cout << "  Blocks rejected: " << stats.BlocksRejected << " accepted: " << stats.BlocksAccepted << " partial: " << stats.BlocksPartial << "\n";
+				std::cout << "  Hi-Z culled triangles: " << stats.TrianglesHiZCulled << " blocks: " << stats.BlocksHiZCulled << "\n";
+				const FrameTimings& timings = NRaster::Instance()->GetLastFrameTimings();
+				std::cout << "  Frame record: " << timings.RecordMS << "ms raster: " << timings.RasterMS << "ms overlap: " << timings.OverlapMS << "ms latency: " << timings.LatencyMS << "ms\n";
+			}
+			NRaster::Instance()->ResetWorkerStats();
+			NRaster::Instance()->ResetStats();
 		}	
 		SDL_UnlockTexture(gContext.Framebuffer);
 		SDL_RenderCopy(gContext.Renderer, gContext.Framebuffer, NULL, NULL);
@@ -174,7 +258,14 @@ bool InitWindowAndRenderer()
 		return false;
 	}
 
-	gContext.DepthBuffer = new float[gContext.Width * gContext.Height];
+	gContext.VisibilityBuffer = new VisibilityId[gContext.Width * gContext.Height];
+	for (int i = 0; i < 2; ++i)
+	{
+		gContext.FrameDepth[i] = new float[gContext.Width * gContext.Height];
+		gContext.FrameColor[i] = new PixelRGBA32[gContext.Width * gContext.Height];
+		memset(gContext.FrameColor[i], 0, gContext.Width * gContext.Height * sizeof(PixelRGBA32));
+	}
+	gContext.DepthBuffer = gContext.FrameDepth[0];
 	return true;
 }
 
@@ -255,34 +346,183 @@ glm::vec4 MyVertexShader(const Vertex& vertex, const VertexRenderData& renderDat
 	return renderData.Projection * renderData.View * renderData.Transform * vertex.Position;
 }
 
+// Same as MyVertexShader, a batch at a time
+void MyVertexBatchShader(const VertexStreams& in, const VertexShaderUniforms& uniforms, ClipPositionStreams& out)
+{
+	const glm::mat4& mvp = uniforms.ModelViewProjection;
+	for (uint32_t i = 0; i < in.Count; ++i)
+	{
+		float x = in.PositionX[i];
+		float y = in.PositionY[i];
+		float z = in.PositionZ[i];
+		float w = in.PositionW[i];
+		out.X[i] = mvp[0][0] * x + mvp[1][0] * y + mvp[2][0] * z + mvp[3][0] * w;
+		out.Y[i] = mvp[0][1] * x + mvp[1][1] * y + mvp[2][1] * z + mvp[3][1] * w;
+		out.Z[i] = mvp[0][2] * x + mvp[1][2] * y + mvp[2][2] * z + mvp[3][2] * w;
+		out.W[i] = mvp[0][3] * x + mvp[1][3] * y + mvp[2][3] * z + mvp[3][3] * w;
+	}
+}
+
 glm::vec4 MyPixelShader(const Vertex& vertex)
 {
 	float NdotL = glm::clamp(glm::dot(glm::normalize(vertex.Normal), glm::vec3(1.0f, 0.5f, 0.0f)),0.1f,1.0f);
 	return glm::vec4(0.5f, 0.5f, 0.8f, 1.0f) * NdotL;
 }
 
-void RenderScene(PixelRGBA32* pixels, int width, int height)
+// Same shaders as functors for the templated pipeline
+struct MyVertexShaderFunctor
+{
+	glm::vec4 operator()(const Vertex& vertex, const VertexShaderUniforms& uniforms) const
+	{
+		return uniforms.ModelViewProjection * vertex.Position;
+	}
+};
+
+struct MyPixelShaderFunctor
+{
+	glm::vec4 operator()(const Vertex& vertex) const
+	{
+		return MyPixelShader(vertex);
+	}
+};
+
+void DrawModel(NModel& model, bool templatedPipeline, ScenePass::T pass)
+{
+	// Skipped before any vertex work if off screen or occluded
+	NRaster::Instance()->SetDrawBounds(&model.GetBounds(), &model.GetBoundingSphere());
+
+	if (!templatedPipeline)
+	{
+		NRaster::Instance()->DrawIndexed(model.GetAllVertex(), model.GetNumVertices(), model.GetIndices(), model.GetNumIndices());
+	}
+	else
+	{
+		DrawModelTemplated(model, pass);
+	}
+
+	NRaster::Instance()->SetDrawBounds(nullptr);
+}
+
+void DrawModelTemplated(NModel& model, ScenePass::T pass)
+{
+	switch (pass)
+	{
+	case ScenePass::DepthPrepass:
+		NRaster::Instance()->Draw<MyVertexShaderFunctor, NoPixelShader, DepthTest::LessThan, WindingOrder::CCW>(model.GetAllVertex(), model.GetNumVertices(), model.GetIndices(), model.GetNumIndices());
+		break;
+	case ScenePass::Shading:
+		NRaster::Instance()->Draw<MyVertexShaderFunctor, MyPixelShaderFunctor, DepthTest::Equal, WindingOrder::CCW, false>(model.GetAllVertex(), model.GetNumVertices(), model.GetIndices(), model.GetNumIndices());
+		break;
+	default:
+		NRaster::Instance()->Draw<MyVertexShaderFunctor, MyPixelShaderFunctor, DepthTest::LessThan, WindingOrder::CCW>(model.GetAllVertex(), model.GetNumVertices(), model.GetIndices(), model.GetNumIndices());
+		break;
+	}
+}
+
+void RenderScene(PixelRGBA32* pixels, float* depthBuffer, int width, int height, bool templatedPipeline, bool depthPrepass, bool occlusionCulling)
 {
 	auto viewMtx = glm::lookAtLH(glm::vec3(0.0f, 2.0f, 4.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
 	auto projMtx = glm::perspectiveFovLH(glm::radians(75.0f), (float)gContext.Width, (float)gContext.Height, 0.05f, 10.0f);
 
-	NRaster::Instance()->SetDepthBuffer(gContext.DepthBuffer);
+	NRaster::Instance()->SetDepthBuffer(depthBuffer);
 	NRaster::Instance()->SetRenderTarget(pixels);
 	NRaster::Instance()->SetViewport(0, 0, gContext.Width, gContext.Height);
-	NRaster::Instance()->SetShaders(MyVertexShader, MyPixelShader);
-	// Teapot
-	auto modelMtx = glm::mat4();
-	modelMtx = glm::translate(modelMtx, glm::vec3(0.0f, -0.5f, 0.0f));
-	modelMtx = glm::scale(modelMtx, glm::vec3(0.02f, 0.02f, 0.02f));
-	modelMtx = glm::rotate(modelMtx, curtime, glm::vec3(0.0f, 1.0f, 0.0f));
-	NRaster::Instance()->SetTransforms(modelMtx, viewMtx, projMtx);
-	NRaster::Instance()->Draw(teapot.GetAllVertex(), teapot.GetNumVertices());
-	// Cube
-	modelMtx = glm::mat4();
-	modelMtx = glm::translate(modelMtx, glm::vec3(0.0f, -1.0f, 0.0f));
-	modelMtx = glm::scale(modelMtx, glm::vec3(4.0f, 0.2f, 4.0f));
-	NRaster::Instance()->SetTransforms(modelMtx, viewMtx, projMtx);
-	NRaster::Instance()->Draw(cube.GetAllVertex(), cube.GetNumVertices());
+	// Through the rasterizer, so the Hi-Z gets cleared too
+	NRaster::Instance()->ClearDepthBuffer(1.0f);
+	// All the draws are binned first and rasterized together by the tiles at EndFrame
+	NRaster::Instance()->BeginFrame();
+
+	auto floorMtx = glm::mat4();
+	floorMtx = glm::translate(floorMtx, glm::vec3(0.0f, -1.0f, 0.0f));
+	floorMtx = glm::scale(floorMtx, glm::vec3(4.0f, 0.2f, 4.0f));
+	if (occlusionCulling)
+	{
+		NRaster::Instance()->ClearOccluders();
+		NRaster::Instance()->SetTransforms(floorMtx, viewMtx, projMtx);
+		NRaster::Instance()->DrawOccluder(cube.GetAllVertex(), cube.GetNumVertices(), cube.GetIndices(), cube.GetNumIndices());
+	}
+
+	// With a prepass the scene is drawn twice, the shading pass only shades the closest pixels
+	int firstPass = depthPrepass ? ScenePass::DepthPrepass : ScenePass::Forward;
+	int lastPass = depthPrepass ? ScenePass::Shading : ScenePass::Forward;
+	for (int p = firstPass; p <= lastPass; ++p)
+	{
+		ScenePass::T pass = (ScenePass::T)p;
+		NRaster::Instance()->SetShaders(MyVertexBatchShader, pass == ScenePass::DepthPrepass ? nullptr : MyPixelShader);
+		NRaster::Instance()->SetDepthTest(pass == ScenePass::Shading ? DepthTest::Equal : DepthTest::LessThan);
+		NRaster::Instance()->SetDepthWrite(pass != ScenePass::Shading);
+		// Teapot
+		auto modelMtx = glm::mat4();
+		modelMtx = glm::translate(modelMtx, glm::vec3(0.0f, -0.5f, 0.0f));
+		modelMtx = glm::scale(modelMtx, glm::vec3(0.02f, 0.02f, 0.02f));
+		modelMtx = glm::rotate(modelMtx, curtime, glm::vec3(0.0f, 1.0f, 0.0f));
+		NRaster::Instance()->SetTransforms(modelMtx, viewMtx, projMtx);
+		DrawModel(teapot, templatedPipeline, pass);
+		// Cube
+		NRaster::Instance()->SetTransforms(floorMtx, viewMtx, projMtx);
+		DrawModel(cube, templatedPipeline, pass);
+		// Small teapots under the floor
+		if (occlusionCulling)
+		{
+			for (int i = 0; i < 8; ++i)
+			{
+				modelMtx = glm::mat4();
+				modelMtx = glm::translate(modelMtx, glm::vec3(-1.4f + 0.4f * i, -2.0f, (float)(i % 3) - 1.0f));
+				modelMtx = glm::scale(modelMtx, glm::vec3(0.004f, 0.004f, 0.004f));
+				NRaster::Instance()->SetTransforms(modelMtx, viewMtx, projMtx);
+				DrawModel(teapot, templatedPipeline, pass);
+			}
+		}
+	}
+	NRaster::Instance()->EndFrame();
 
 	curtime += 0.014f;
 }
+
+void BenchmarkModelLoading()
+{
+	const char* paths[] = { "../../Data/teapot.obj", "../../Data/suzanne.obj" };
+	const uint32_t loaders[] = { 0, ModelLoadFlags::ParallelParser };
+	const char* loaderNames[] = { "tinyobj", "NObjParser" };
+	const int numRuns = 5;
+
+	for (int p = 0; p < 2; ++p)
+	{
+		for (int l = 0; l < 2; ++l)
+		{
+			// Best of a few runs, skipping the cache and the optimization pass
+			float bestMS = FLT_MAX;
+			for (int r = 0; r < numRuns; ++r)
+			{
+				NModel model;
+				auto tstart = NProfilerGet()->Now();
+				model.LoadFromfile(paths[p], loaders[l] | ModelLoadFlags::NoCache);
+				auto tend = NProfilerGet()->Now();
+				bestMS = glm::min(bestMS, NProfilerGet()->TimeDiffMS(tstart, tend));
+			}
+			std::cout << "[Benchmark]: " << paths[p] << " " << loaderNames[l] << ": " << bestMS << "ms\n";
+		}
+	}
+}
+
+void BenchmarkPipelines()
+{
+	const char* pipelineNames[] = { "Function pointers", "Templated" };
+	const int numFrames = 50;
+	std::vector<PixelRGBA32> pixels(gContext.Width * gContext.Height);
+
+	for (int p = 0; p < 2; ++p)
+	{
+		// Best frame, both render the same scene
+		float bestMS = FLT_MAX;
+		for (int f = 0; f < numFrames; ++f)
+		{
+			auto tstart = NProfilerGet()->Now();
+			RenderScene(pixels.data(), gContext.DepthBuffer, gContext.Width, gContext.Height, p == 1);
+			auto tend = NProfilerGet()->Now();
+			bestMS = glm::min(bestMS, NProfilerGet()->TimeDiffMS(tstart, tend));
+		}
+		std::cout << "[Benchmark]: " << pipelineNames[p] << ": " << bestMS << "ms\n";
+	}
+	NRaster::Instance()->ResetStats();
+}